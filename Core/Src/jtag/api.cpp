@@ -6,10 +6,14 @@
  */
 
 
+#include <algorithm>
 #include <array>
+#include <cstring>
 
 #include "api.hpp"
 #include "bitbang.hpp"
+#include "spi.hpp"
+#include "waveform.hpp"
 
 
 namespace jtag {
@@ -25,6 +29,100 @@ namespace jtag {
     // https://www.element14.com/community/docs/DOC-60353/l/stmicroelectronics-bsdl-files-for-stm32-boundary-scan-description-language
     uint8_t drOpcodeLen = 32;
 
+    // Order of the scanCompare within the current batch, identifies the mismatch records
+    uint32_t compareIndex = 0;
+
+
+    bool     packedResponses = false;
+    uint32_t *packedWord     = nullptr; // the partially filled word of the packed reads
+    uint32_t packedBits      = 0;       // how many bits of the packedWord are used, 0 = none or full
+
+
+    uint32_t *requestEnd  = nullptr;    // where the request stream of the current batch ends
+    uint32_t *responseEnd = nullptr;    // where the response buffer of the current batch ends
+    bool     rejected     = false;      // some command of the current batch was rejected
+
+
+    // Invoked before each batch (USB transfer/HID frames) starts executing
+    void batchStart(uint32_t *batchRequestEnd, uint32_t *batchResponseEnd) {
+      compareIndex = 0;
+      packedBits   = 0;
+      requestEnd   = batchRequestEnd;
+      responseEnd  = batchResponseEnd;
+      rejected     = false;
+    }
+
+
+    bool batchRejected() {
+      return rejected;
+    }
+
+
+    // How many words are left in the request stream and in the response buffer of the current batch
+    uint32_t requestLeft(const uint32_t *req) {
+      return (req < requestEnd) ? requestEnd - req : 0;
+    }
+
+
+    uint32_t responseLeft(const uint32_t *res) {
+      return (res < responseEnd) ? responseEnd - res : 0;
+    }
+
+
+    // Command which doesn't fit into its batch (its data go past the request stream, or its response
+    // wouldn't fit the response buffer) is not executed at all, its remaining argument words are
+    // skipped (up to the end of the request stream) and nothing is responded
+    requestAndResponse reject(uint32_t *req, uint32_t *res, uint32_t words) {
+      rejected = true;
+      req += std::min(words, requestLeft(req));
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    // Length in bits to words, without overflowing for the lengths close to the 2^32
+    uint32_t wordsOf(uint32_t length) {
+      return length / 32 + ((length % 32) ? 1 : 0);
+    }
+
+
+    // Append the read value to the response, whole word or the packed bits depending on the response format
+    uint32_t *appendRead(uint32_t *res, uint32_t value, uint32_t length) {
+      if (!packedResponses) {
+        *res=value;
+        res++;
+        return res;
+      }
+
+      if (length < 32) value &= (1u << length) - 1;
+
+      if (packedBits && packedWord == res - 1) {
+        // Nothing was responded since the last packed read, continue in its word and spill into a new one
+        *packedWord |= value << packedBits;
+        if (packedBits + length > 32) {
+          *res=value >> (32 - packedBits);
+          packedWord = res;
+          res++;
+        }
+        packedBits = (packedBits + length) % 32;
+      } else {
+        *res=value;
+        packedWord = res;
+        res++;
+        packedBits = length % 32;
+      }
+
+      return res;
+    }
+
+
+    requestAndResponse responseFormat(uint32_t *req, uint32_t *res) {
+      packedResponses = (*req != 0);
+      req++;
+
+      packedBits = 0;
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
 
     requestAndResponse nop(uint32_t *req, uint32_t *res) {
       return JTAG_COMBINE_REQ_RES(req, res);
@@ -44,6 +142,8 @@ namespace jtag {
 
     // Respond to ping with own FW version
     requestAndResponse ping(uint32_t *req, uint32_t *res) {
+      if (responseLeft(res) < 1) return reject(req, res, 0);
+
       *res=JTAG_FW_VERSION;
       res++;
       return JTAG_COMBINE_REQ_RES(req, res);
@@ -54,11 +154,35 @@ namespace jtag {
       uint32_t type = *req;
       req++;
 
+      tap::flush(); // The reset is clocked from the state where the TAP really is
       bitbang::resetSignal(type, -1);
       return JTAG_COMBINE_REQ_RES(req, res);
     }
 
 
+    template<bool isWrite>
+    requestAndResponse tck(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are [FREQUENCY], responds with the achieved FREQUENCY and DUTY (in 0.1% units)
+      if (responseLeft(res) < 2) return reject(req, res, (isWrite) ? 1 : 0);
+
+      bitbang::tckSpeedS speed;
+
+      if (isWrite) {
+        tap::flush(); // A deferred move belongs to the commands before, clock it with their TCK speed
+        speed = bitbang::tckSet(*req);
+        req++;
+      } else {
+        speed = bitbang::tckGet();
+      }
+
+      *res = speed.frequency;
+      res++;
+      *res = speed.dutyPermille;
+      res++;
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
     requestAndResponse stateMove(uint32_t *req, uint32_t *res) {
       auto endState = (tap::stateE)(*req);
       req++;
@@ -77,13 +201,21 @@ namespace jtag {
     }
 
 
+    void runIdle(uint32_t count) {
+      // Get into the RunTestIdle once and then just toggle the TCK (TMS is low so it stays there)
+      if (count > 0) {
+        tap::flush(); // A pending RunTestIdle has to be clocked fully, the idle cycles are counted from there
+        tap::stateMove(tap::stateE::RunTestIdle);
+        bitbang::clockIdle(count - 1);
+      }
+    }
+
+
     requestAndResponse runTest(uint32_t *req, uint32_t *res) {
       uint32_t count = *req;
       req++;
 
-      for (uint32_t i = 0; i < count; i++) {
-        tap::stateMove(tap::stateE::RunTestIdle);
-      }
+      runIdle(count);
       return JTAG_COMBINE_REQ_RES(req, res);
     }
 
@@ -102,6 +234,147 @@ namespace jtag {
     }
 
 
+    // The TAPs daisy-chained on the JTAG, position 0 is the TAP closest to the TDO (its bits come out first).
+    // All other than the active TAP are kept in the BYPASS, the scans insert the padding bits for them
+    // (prefix for the TAPs between the active one and the TDO, suffix for the ones between the TDI and it)
+    // and the captured bits of the padding are not responded. Without any chain setup there is no padding.
+    namespace chain {
+
+      struct tapS {
+        uint8_t  irLength;
+        uint32_t idcode;   // 0 = TAP without the IDCODE register (its DR is in BYPASS after the reset)
+      };
+
+
+      std::array<tapS, JTAG_CHAIN_MAX_TAPS> taps = {};
+      uint32_t tapCount  = 0;
+      uint32_t activeTap = 0;
+
+      uint32_t irPrefix  = 0;  // amount of the padding bits shifted before/after the active TAP's bits
+      uint32_t irSuffix  = 0;
+      uint32_t drPrefix  = 0;
+      uint32_t drSuffix  = 0;
+
+
+      void select(uint32_t index) {
+        activeTap = index;
+        irPrefix  = 0;
+        irSuffix  = 0;
+
+        for (uint32_t i = 0; i < tapCount; i++) {
+          if (i < index) irPrefix += taps[i].irLength;
+          if (i > index) irSuffix += taps[i].irLength;
+        }
+
+        // Each bypassed TAP has 1-bit DR
+        drPrefix = index;
+        drSuffix = (tapCount > index) ? tapCount - index - 1 : 0;
+
+        if (index < tapCount) irOpcodeLen = taps[index].irLength;
+
+#ifdef JTAG_IR_CACHE
+        // The cached instruction belongs to the previously active TAP
+        tap::irCache::invalidate();
+#endif
+      }
+
+
+      void prefix(tap::stateE shiftState) {
+        // The BYPASS instruction is all ones, the bypassed DR bits don't matter
+        if (shiftState == tap::stateE::ShiftIr) {
+          bitbang::shiftTdiFill(irPrefix, true, nullptr, {0, 0});
+        } else {
+          bitbang::shiftTdiFill(drPrefix, false, nullptr, {0, 0});
+        }
+      }
+
+
+      // Gets into the shift state and through the prefix, returns the exit path to the endState. The exit is not
+      // moved here, the last bit of the scan leaves the shift state, a separate move would shift one more bit
+      tap::tmsMove enter(tap::stateE shiftState, tap::stateE endState) {
+        if (tap::currentState != shiftState) tap::stateMove(shiftState);
+        prefix(shiftState);
+        return tap::exitMove(endState);
+      }
+
+
+      // The exit path is shifted together with the last bit of the scan, which is the last suffix bit,
+      // or the last data bit when there is no suffix
+      tap::tmsMove dataExit(tap::stateE shiftState, tap::tmsMove exit) {
+        const uint32_t after = (shiftState == tap::stateE::ShiftIr) ? irSuffix : drSuffix;
+        return (after == 0) ? exit : tap::tmsMove{0, 0};
+      }
+
+
+      void suffix(tap::stateE shiftState, tap::tmsMove exit) {
+        if (shiftState == tap::stateE::ShiftIr) {
+          bitbang::shiftTdiFill(irSuffix, true, nullptr, exit);
+        } else {
+          bitbang::shiftTdiFill(drSuffix, false, nullptr, exit);
+        }
+      }
+
+
+      // Same as the tap::fusedScan (length <= 32), but with the padding of the bypassed TAPs
+      uint32_t scan(tap::stateE shiftState, uint32_t length, uint32_t writeValue, tap::stateE endState) {
+        const bool     isIr   = (shiftState == tap::stateE::ShiftIr);
+        const uint32_t before = (isIr) ? irPrefix : drPrefix;
+        const uint32_t after  = (isIr) ? irSuffix : drSuffix;
+
+        if (before + after == 0 || length == 0) {
+          // Single TAP (or the chain is not described), nothing to add. Or nothing to shift, just the moves
+          return tap::fusedScan(shiftState, length, writeValue, endState);
+        }
+
+        const uint32_t total = before + length + after;
+        const uint32_t data  = (length < 32) ? writeValue & ((1u << length) - 1) : writeValue;
+
+        if (total <= 32) {
+          // The padding and the data are merged into one value and shifted in one fused kernel pass
+          const uint32_t ones  = (total < 32) ? (1u << total) - 1 : 0xffff'ffff;
+          const uint32_t fill  = (isIr) ? ones & ~(((length < 32) ? (1u << length) - 1 : 0xffff'ffff) << before) : 0;
+          const uint32_t read  = tap::fusedScan(shiftState, total, fill | (data << before), endState);
+          return (length < 32) ? (read >> before) & ((1u << length) - 1) : read >> before;
+        }
+
+        // Too long for one word, the padding is shifted by the fill kernel while staying in the shift state
+        // and the last bit of the scan (the last suffix bit, or the last data bit without suffix) leaves it
+        const auto exit = enter(shiftState, endState);
+        uint32_t read = 0;
+        bitbang::shiftTdiBuffer(length, &data, &read, dataExit(shiftState, exit));
+        suffix(shiftState, exit);
+        return read;
+      }
+
+
+      // Append the value at the bit offset of the chain-wide vector, position 0 goes first (ends closest to the TDO)
+      void packBits(uint32_t *vector, uint32_t &offset, uint32_t value, uint32_t length) {
+        if (length < 32) value &= (1u << length) - 1;
+
+        const uint32_t word  = offset / 32;
+        const uint32_t shift = offset % 32;
+
+        vector[word] |= value << shift;
+        if (shift + length > 32) vector[word + 1] |= value >> (32 - shift);
+
+        offset += length;
+      }
+
+
+      uint32_t unpackBits(const uint32_t *vector, uint32_t &offset, uint32_t length) {
+        const uint32_t word  = offset / 32;
+        const uint32_t shift = offset % 32;
+
+        uint32_t value = vector[word] >> shift;
+        if (shift + length > 32) value |= vector[word + 1] << (32 - shift);
+
+        offset += length;
+        return (length < 32) ? value & ((1u << length) - 1) : value;
+      }
+
+    }
+
+
     namespace scan {
 
 
@@ -137,14 +410,15 @@ namespace jtag {
 
       template<captureE capture, accessE access, endstateE endstate, opcodeLengthE opcodeLength, lenSizeFitsE lenSize>
       requestAndResponse generic(uint32_t *req, uint32_t *res) {
-        // Arguments in the stream are DATA, [LEN], [END_STATE]
+        // Arguments in the stream are DATA, [DATA_HIGH], [LEN], [END_STATE]
         uint32_t data = *req;
         req++;
 
-        if (capture == captureE::ir) {
-          tap::stateMove(tap::stateE::ShiftIr);
-        } else {
-          tap::stateMove(tap::stateE::ShiftDr);
+        uint32_t dataHigh = 0;
+        if (lenSize == lenSizeFitsE::over32) {
+          // 64-bit data are sent as two words, the lower word first
+          dataHigh = *req;
+          req++;
         }
 
         uint32_t length;
@@ -157,23 +431,729 @@ namespace jtag {
           req++;
         }
 
-        uint32_t read = bitbang::shiftTdi(length, data);
+        tap::stateE endState;
+        if (endstate == endstateE::useGlobal) {
+          // Go to the globally specified end state
+          endState = defaultEndState;
+        } else {
+          // Read from the request packet what end state should go to
+          endState = (tap::stateE)(*req);
+          req++;
+        }
+
+        // The read responds up to one word per 32 bits (the packed reads can spill into one)
+        const uint32_t readWords = (lenSize == lenSizeFitsE::over32) ? 2 : 1;
+        if (access == accessE::readAndWrite && responseLeft(res) < readWords) return reject(req, res, 0);
+
+        const auto shiftState = (capture == captureE::ir) ? tap::stateE::ShiftIr : tap::stateE::ShiftDr;
+
+#ifdef JTAG_IR_CACHE
+        if (capture == captureE::ir) {
+          if (lenSize == lenSizeFitsE::over32) {
+            // Only IRs up to 32-bit are cached
+            tap::irCache::invalidate();
+          } else if (access == accessE::readAndWrite) {
+            tap::irCache::shifted(data, length);
+          } else if (tap::irCache::isHit(data, length)) {
+            // The same instruction is already in the IR, just end up in the expected state
+            tap::endStateMove(endState);
+            return JTAG_COMBINE_REQ_RES(req, res);
+          } else {
+            tap::irCache::update(data, length);
+          }
+        }
+#endif
+
+        if (lenSize == lenSizeFitsE::over32) {
+          if (length <= 32 || length > 64) return failure(req, res);
+
+          // Both halves are shifted by a single kernel invocation
+          const auto exit = chain::enter(shiftState, endState);
+          uint64_t read = bitbang::shiftTdi64(length, (static_cast<uint64_t>(dataHigh) << 32) | data, chain::dataExit(shiftState, exit));
+          chain::suffix(shiftState, exit);
+
+          if (access == accessE::readAndWrite) {
+            // Send back to the USB what you read, the lower word first
+            res = appendRead(res, static_cast<uint32_t>(read), 32);
+            res = appendRead(res, static_cast<uint32_t>(read >> 32), length - 32);
+          }
+        } else {
+          // Entry path, data and exit path are shifted in one go
+          uint32_t read = chain::scan(shiftState, length, data, endState);
+
+          if (access == accessE::readAndWrite) {
+            // Send back to the USB what you read
+            res = appendRead(res, read, length);
+          }
+        }
+
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+
+      // The DMA backends shift only inside the Shift-xR, the last bit with the exit path is left to the bit-bang kernel
+      void shiftBuffer(uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer, tap::tmsMove exit) {
+        const uint32_t bulk = (exit.amountOfBitsToShift) ? length - 1 : length;
+
+#ifdef JTAG_SPI
+        // The whole bytes go through the SPI
+        if (spi::isSelected(bulk)) {
+          spi::shiftTdiBuffer(bulk, writeBuffer, readBuffer);
+          if (bulk != length) bitbang::shiftLastBit(bulk, (writeBuffer[bulk / 32] >> (bulk % 32)) & 1, readBuffer, exit);
+          return;
+        }
+#endif
+
+#ifdef JTAG_WAVEFORM
+        // Long enough scans are left to the timer + DMA, the CPU is not blocked while they are on the wire
+        if (waveform::isSelected(bulk)) {
+          waveform::shiftTdiBuffer(bulk, writeBuffer, readBuffer);
+          if (bulk != length) bitbang::shiftLastBit(bulk, (writeBuffer[bulk / 32] >> (bulk % 32)) & 1, readBuffer, exit);
+          return;
+        }
+#endif
+        bitbang::shiftTdiBuffer(length, writeBuffer, readBuffer, exit);
+      }
+
+
+      template<captureE capture, accessE access>
+      requestAndResponse buffer(uint32_t *req, uint32_t *res) {
+        // Arguments in the stream are LEN, DATA[(LEN+31)/32]
+        uint32_t length = *req;
+        req++;
+
+        const uint32_t words = wordsOf(length);
+        if (words > requestLeft(req) || (access == accessE::readAndWrite && words > responseLeft(res))) {
+          return reject(req, res, words);
+        }
+
+        const auto shiftState = (capture == captureE::ir) ? tap::stateE::ShiftIr : tap::stateE::ShiftDr;
+
+#ifdef JTAG_IR_CACHE
+        if (capture == captureE::ir) tap::irCache::invalidate();
+#endif
+        if (length == 0) {
+          // Nothing to shift, just do the moves on their own
+          tap::stateMove(shiftState);
+          tap::endStateMove(defaultEndState);
+          return JTAG_COMBINE_REQ_RES(req, res);
+        }
+
+        const auto exit = chain::enter(shiftState, defaultEndState);
 
         if (access == accessE::readAndWrite) {
-          // Send back to the USB what you read
-          *res=read;
-          res++;
+          // Captured TDO words are written directly into the response stream
+          shiftBuffer(length, req, res, chain::dataExit(shiftState, exit));
+          res += words;
+        } else {
+          shiftBuffer(length, req, nullptr, chain::dataExit(shiftState, exit));
         }
+        req += words;
 
-        if (endstate == endstateE::useGlobal) {
-          // Go to the globally specified end state
-          tap::stateMove(defaultEndState);
+        chain::suffix(shiftState, exit);
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+
+      template<captureE capture, accessE access>
+      requestAndResponse fill(uint32_t *req, uint32_t *res) {
+        // Arguments in the stream are LEN, FILL (the TDI value shifted for all the bits)
+        uint32_t length = *req;
+        req++;
+
+        bool fillBit = (*req != 0);
+        req++;
+
+        const uint32_t words = wordsOf(length);
+        if (access == accessE::readAndWrite && words > responseLeft(res)) return reject(req, res, 0);
+
+        const auto shiftState = (capture == captureE::ir) ? tap::stateE::ShiftIr : tap::stateE::ShiftDr;
+
+#ifdef JTAG_IR_CACHE
+        if (capture == captureE::ir) tap::irCache::invalidate();
+#endif
+        if (length == 0) {
+          // Nothing to shift, just do the moves on their own
+          tap::stateMove(shiftState);
+          tap::endStateMove(defaultEndState);
+          return JTAG_COMBINE_REQ_RES(req, res);
+        }
+
+        const auto exit = chain::enter(shiftState, defaultEndState);
+
+        if (access == accessE::readAndWrite) {
+          // Captured TDO words are written directly into the response stream
+          bitbang::shiftTdiFill(length, fillBit, res, chain::dataExit(shiftState, exit));
+          res += words;
         } else {
-          // Read from the request packet what end state should go to
-          auto endState = (tap::stateE)(*req);
+          bitbang::shiftTdiFill(length, fillBit, nullptr, chain::dataExit(shiftState, exit));
+        }
+
+        chain::suffix(shiftState, exit);
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+
+      template<accessE access, opcodeLengthE opcodeLength>
+      requestAndResponse irThenDr(uint32_t *req, uint32_t *res) {
+        // Arguments in the stream are IR_DATA, DR_DATA, [IR_LEN, DR_LEN]
+        uint32_t irData = *req;
+        req++;
+
+        uint32_t drData = *req;
+        req++;
+
+        uint32_t irLength = irOpcodeLen;
+        uint32_t drLength = drOpcodeLen;
+        if (opcodeLength == opcodeLengthE::readFromStream) {
+          irLength = *req;
+          req++;
+
+          drLength = *req;
           req++;
-          tap::stateMove(endState);
         }
+
+        if (access == accessE::readAndWrite && responseLeft(res) < 1) return reject(req, res, 0);
+
+#ifdef JTAG_IR_CACHE
+        // When the same instruction is in the IR already, then the DR scan will do the entry path on its own
+        if (!tap::irCache::isHit(irData, irLength)) {
+          tap::irCache::update(irData, irLength);
+          chain::scan(tap::stateE::ShiftIr, irLength, irData, tap::stateE::ShiftDr);
+        }
+#else
+        // The IR scan ends directly in the ShiftDr, using the shortest path through the UpdateIr
+        chain::scan(tap::stateE::ShiftIr, irLength, irData, tap::stateE::ShiftDr);
+#endif
+
+        // Already in the ShiftDr (unless the IR scan was skipped) so no entry path is needed
+        uint32_t read = chain::scan(tap::stateE::ShiftDr, drLength, drData, defaultEndState);
+
+        if (access == accessE::readAndWrite) {
+          res = appendRead(res, read, drLength);
+        }
+
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+
+      template<captureE capture, opcodeLengthE opcodeLength>
+      requestAndResponse poll(uint32_t *req, uint32_t *res) {
+        // Arguments in the stream are DATA, MASK, VALUE, MAX_ATTEMPTS, IDLE_CYCLES, [LEN]
+        uint32_t data = *req;
+        req++;
+
+        uint32_t mask = *req;
+        req++;
+
+        uint32_t value = *req;
+        req++;
+
+        uint32_t maxAttempts = *req;
+        req++;
+
+        uint32_t idleCycles = *req;
+        req++;
+
+        uint32_t length = (capture == captureE::ir) ? irOpcodeLen : drOpcodeLen;
+        if (opcodeLength == opcodeLengthE::readFromStream) {
+          length = *req;
+          req++;
+        }
+
+        // Responds the last read and the attempts
+        if (responseLeft(res) < 2) return reject(req, res, 0);
+
+        const auto shiftState = (capture == captureE::ir) ? tap::stateE::ShiftIr : tap::stateE::ShiftDr;
+
+#ifdef JTAG_IR_CACHE
+        if (capture == captureE::ir) {
+          tap::irCache::shifted(data, length);
+        }
+#endif
+
+        // The same scan is repeated until the captured value matches, there is always at least one attempt
+        uint32_t read;
+        uint32_t attempts = 0;
+        while (true) {
+          read = chain::scan(shiftState, length, data, defaultEndState);
+          attempts++;
+
+          if ((read & mask) == value || attempts >= maxAttempts) break;
+
+          runIdle(idleCycles);
+        }
+
+        // Only the last captured value is returned, when it doesn't match then the attempts ran out
+        *res=read;
+        res++;
+        *res=attempts;
+        res++;
+
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+
+      template<captureE capture, opcodeLengthE opcodeLength>
+      requestAndResponse compare(uint32_t *req, uint32_t *res) {
+        // Arguments in the stream are DATA, EXPECTED, MASK, [LEN]
+        uint32_t data = *req;
+        req++;
+
+        uint32_t expected = *req;
+        req++;
+
+        uint32_t mask = *req;
+        req++;
+
+        uint32_t length = (capture == captureE::ir) ? irOpcodeLen : drOpcodeLen;
+        if (opcodeLength == opcodeLengthE::readFromStream) {
+          length = *req;
+          req++;
+        }
+
+        // A mismatch responds a record of two words
+        if (responseLeft(res) < 2) return reject(req, res, 0);
+
+        const auto shiftState = (capture == captureE::ir) ? tap::stateE::ShiftIr : tap::stateE::ShiftDr;
+
+#ifdef JTAG_IR_CACHE
+        if (capture == captureE::ir) {
+          tap::irCache::shifted(data, length);
+        }
+#endif
+
+        uint32_t read = chain::scan(shiftState, length, data, defaultEndState);
+
+        if ((read ^ expected) & mask) {
+          // Respond only when it doesn't match
+          *res=compareIndex;
+          res++;
+          *res=read;
+          res++;
+        }
+        compareIndex++;
+
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+
+      // The compareBuffer captures here first, its request has 3 words for each captured word
+      std::array<uint32_t, std::max(JTAG_USB_STREAM_WORDS, JTAG_USB_BULK_WORDS) / 3> compareCaptured;
+
+
+      template<captureE capture>
+      requestAndResponse compareBuffer(uint32_t *req, uint32_t *res) {
+        // Arguments in the stream are LEN, DATA[(LEN+31)/32], EXPECTED[(LEN+31)/32], MASK[(LEN+31)/32]
+        uint32_t length = *req;
+        req++;
+
+        // All the words could mismatch, each mismatch responds a record of two words
+        const uint32_t words = wordsOf(length);
+        if (words > compareCaptured.size() || 3 * words > requestLeft(req) || 2 * words > responseLeft(res)) {
+          return reject(req, res, 3 * words);
+        }
+
+        const auto shiftState = (capture == captureE::ir) ? tap::stateE::ShiftIr : tap::stateE::ShiftDr;
+
+#ifdef JTAG_IR_CACHE
+        if (capture == captureE::ir) tap::irCache::invalidate();
+#endif
+        if (length == 0) {
+          // Nothing to shift or compare, just do the moves on their own
+          tap::stateMove(shiftState);
+          tap::endStateMove(defaultEndState);
+          compareIndex++;
+          return JTAG_COMBINE_REQ_RES(req, res);
+        }
+
+        const auto exit = chain::enter(shiftState, defaultEndState);
+        bitbang::shiftTdiBuffer(length, req, compareCaptured.data(), chain::dataExit(shiftState, exit));
+        chain::suffix(shiftState, exit);
+
+        const uint32_t *expected = req + words;
+        const uint32_t *mask     = req + 2 * words;
+
+        for (uint32_t i = 0; i < words; i++) {
+          if ((compareCaptured[i] ^ expected[i]) & mask[i]) {
+            *res=compareIndex | (i << 16);
+            res++;
+            *res=compareCaptured[i];
+            res++;
+          }
+        }
+        compareIndex++;
+        req += 3 * words;
+
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+    }
+
+
+    requestAndResponse vector(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are LEN, TMS[(LEN+31)/32], TDI[(LEN+31)/32]
+      uint32_t length = *req;
+      req++;
+
+      const uint32_t words = wordsOf(length);
+      if (2 * words > requestLeft(req) || words > responseLeft(res)) return reject(req, res, 2 * words);
+
+      // Captured TDO words are written directly into the response stream
+      tap::vectorShift(length, req, req + words, res);
+      req += 2 * words;
+      res += words;
+
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    requestAndResponse chainSetup(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are COUNT, {IR_LEN, IDCODE}[COUNT], responds with a bitmask of the positions
+      // which didn't read back the expected IDCODE (or the BYPASS bit) after the reset
+      uint32_t count = *req;
+      req++;
+
+      // The description is skipped up to the end of the request, without overflowing for the huge counts
+      const uint32_t words = (count <= requestLeft(req) / 2) ? 2 * count : requestLeft(req);
+      if (responseLeft(res) < 1) return reject(req, res, words);
+
+      // Each position of the chain-wide IR vector can hold at most 32 bits
+      bool isValid = (count <= JTAG_CHAIN_MAX_TAPS && 2 * count <= requestLeft(req));
+      for (uint32_t i = 0; isValid && i < count; i++) {
+        isValid = (req[2 * i] != 0 && req[2 * i] <= 32);
+      }
+
+      if (!isValid) {
+        // Can't hold the whole chain, skip the description and report every position as a mismatch
+        *res = 0xffff'ffff;
+        res++;
+        req += words;
+        return JTAG_COMBINE_REQ_RES(req, res);
+      }
+
+      for (uint32_t i = 0; i < count; i++) {
+        chain::taps[i].irLength = static_cast<uint8_t>(req[0]);
+        chain::taps[i].idcode   = req[1];
+        req += 2;
+      }
+      chain::tapCount = count;
+
+      // After the reset each TAP has in its DR either the IDCODE (LSB is 1) or the BYPASS (single 0 bit),
+      // reading them all in one DR pass verifies the chain matches the description
+      tap::flush();
+      tap::resetSM();
+      tap::stateMove(tap::stateE::ShiftDr);
+
+      uint32_t mismatches = 0;
+      for (uint32_t i = 0; i < count; i++) {
+        const uint32_t expected = chain::taps[i].idcode;
+        const uint32_t length   = (expected != 0) ? 32 : 1;
+        const uint32_t read     = bitbang::shiftTdi(length, 0xffff'ffff);
+
+        if ((length == 32 && read != expected) || (length == 1 && (read & 1) != 0)) {
+          mismatches |= 1u << i;
+        }
+      }
+
+      tap::stateMove(tap::stateE::RunTestIdle);
+
+      // Previously active TAP might not be present anymore
+      chain::select(0);
+
+      *res = mismatches;
+      res++;
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    requestAndResponse chainScan(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are {IR, DR_LEN, DR}[chain::tapCount], responds with the DR read of each position.
+      // All the IRs are shifted in one IR pass, then it moves directly to the ShiftDr and all the DRs are shifted
+      // in one DR pass, so every TAP of the chain gets its instruction updated at the same TCK edge.
+      // DR_LEN 0 is a TAP left in the BYPASS (its IR has to be the BYPASS instruction), it gets the 1-bit padding.
+      const uint32_t count = chain::tapCount;
+      if (count == 0) return failure(req, res);
+
+      if (3 * count > requestLeft(req) || count > responseLeft(res)) return reject(req, res, 3 * count);
+
+      // Each position holds at most 32 bits, a longer DR can't be scanned
+      for (uint32_t i = 0; i < count; i++) {
+        if (req[3 * i + 1] > 32) return reject(req, res, 3 * count);
+      }
+
+      // Each position holds at most 32 bits, one more word for the data crossing the word boundary
+      std::array<uint32_t, JTAG_CHAIN_MAX_TAPS + 1> irVector = {};
+      std::array<uint32_t, JTAG_CHAIN_MAX_TAPS + 1> drVector = {};
+      std::array<uint32_t, JTAG_CHAIN_MAX_TAPS + 1> drCaptured;
+      std::array<uint32_t, JTAG_CHAIN_MAX_TAPS>     drLengths;
+
+      uint32_t irTotal = 0;
+      uint32_t drTotal = 0;
+      for (uint32_t i = 0; i < count; i++) {
+        chain::packBits(irVector.data(), irTotal, req[0], chain::taps[i].irLength);
+
+        drLengths[i] = (req[1] == 0) ? 1 : req[1];
+        chain::packBits(drVector.data(), drTotal, req[2], drLengths[i]);
+        req += 3;
+      }
+
+#ifdef JTAG_IR_CACHE
+      tap::irCache::invalidate();
+#endif
+
+      // The IR capture is not needed, the DR is captured into its own vector (the buffer kernel stores the captured
+      // words before it reads the last TDI bit, so it can't shift in place). The last bit of each pass is
+      // shifted together with its exit path, a separate move after the pass would shift one more bit
+      if (tap::currentState != tap::stateE::ShiftIr) tap::stateMove(tap::stateE::ShiftIr);
+      const auto irExit = tap::exitMove(tap::stateE::ShiftDr);
+      bitbang::shiftTdiBuffer(irTotal, irVector.data(), nullptr, irExit);
+
+      const auto drExit = tap::exitMove(defaultEndState);
+      bitbang::shiftTdiBuffer(drTotal, drVector.data(), drCaptured.data(), drExit);
+
+      // Split the captured TDO back per position
+      uint32_t offset = 0;
+      for (uint32_t i = 0; i < count; i++) {
+        *res = chain::unpackBits(drCaptured.data(), offset, drLengths[i]);
+        res++;
+      }
+
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    requestAndResponse gangScan(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are IS_DR, LEN, TDI_SLICES[(LEN+3)/4], responds TDO_SLICES[(LEN+3)/4]
+      // Each slice byte is one TCK for all the gang chains, bit N belongs to the chain N
+      const bool     isDr   = (*req != 0);
+      const uint32_t length = req[1];
+      req += 2;
+
+      // Slices are bytes, without overflowing for the lengths close to the 2^32
+      const uint32_t words = length / 4 + ((length % 4) ? 1 : 0);
+
+#ifdef JTAG_GANG
+      if (length == 0 || words > requestLeft(req) || words > responseLeft(res)) return reject(req, res, words);
+
+      // All the chains share the TMS, so they walk the same states as the single chain
+      const auto shiftState = (isDr) ? tap::stateE::ShiftDr : tap::stateE::ShiftIr;
+
+#ifdef JTAG_IR_CACHE
+      if (!isDr) tap::irCache::invalidate();
+#endif
+      tap::stateMove(shiftState);
+
+      // Captured slices are written directly into the response stream, the unused bytes of the last word are cleared
+      res[words - 1] = 0;
+      bitbang::shiftGang(length, reinterpret_cast<const uint8_t *>(req), reinterpret_cast<uint8_t *>(res));
+      req += words;
+      res += words;
+
+      tap::endStateMove(defaultEndState);
+      return JTAG_COMBINE_REQ_RES(req, res);
+#else
+      // Built without the gang pins, skip the slices
+      (void)isDr;
+      req += std::min(words, requestLeft(req));
+      return failure(req, res);
+#endif
+    }
+
+
+    requestAndResponse waveformSetup(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are THRESHOLD, responds with the fastest stable TCK of the waveform backend (in Hz).
+      // The scanLong buffers of THRESHOLD bits or longer are then shifted by the backend, 0 disables it
+      if (responseLeft(res) < 1) return reject(req, res, 1);
+
+      uint32_t threshold = *req;
+      req++;
+
+#ifdef JTAG_WAVEFORM
+      // The calibration clocks TCK with TMS low, which is harmless only in the RunTestIdle
+      tap::flush();
+      tap::stateMove(tap::stateE::RunTestIdle);
+      *res = waveform::setup(threshold);
+#else
+      (void)threshold;
+      *res = 0;
+#endif
+      res++;
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    requestAndResponse spiSetup(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are THRESHOLD, FREQUENCY, responds with the achieved SPI TCK (in Hz).
+      // The scanLong buffers of THRESHOLD bits or longer are then shifted by the SPI backend, 0 disables it
+      if (responseLeft(res) < 1) return reject(req, res, 2);
+
+      uint32_t threshold = req[0];
+      uint32_t frequency = req[1];
+      req += 2;
+
+#ifdef JTAG_SPI
+      *res = spi::setup(threshold, frequency);
+#else
+      (void)threshold;
+      (void)frequency;
+      *res = 0;
+#endif
+      res++;
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    requestAndResponse irqChunk(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are WORDS, responds with the longest IRQ-disabled window (DWT cycles) of the
+      // long shifts since the previous irqChunk (0 when built without the JTAG_IRQ_LATENCY)
+      if (responseLeft(res) < 1) return reject(req, res, 1);
+
+      *res = bitbang::irqChunk(*req);
+      req++;
+      res++;
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    requestAndResponse chainSelect(uint32_t *req, uint32_t *res) {
+      // Arguments in the stream are INDEX, the IR length of the selected TAP becomes the setIrOpcodeLen
+      uint32_t index = *req;
+      req++;
+
+      if (index < chain::tapCount) chain::select(index);
+      return JTAG_COMBINE_REQ_RES(req, res);
+    }
+
+
+    namespace compact {
+
+      uint32_t argumentBytes(compactWidthE width) {
+        switch (width) {
+          case compactWidthE::width8:  return 1;
+          case compactWidthE::width16: return 2;
+          case compactWidthE::width32: return 4;
+          default:                     return 0;
+        }
+      }
+
+
+      uint32_t readArgument(const uint8_t *&cursor, compactWidthE width) {
+        uint32_t value = 0;
+
+        switch (width) {
+          case compactWidthE::width8:
+            value = *cursor;
+            cursor++;
+            break;
+
+          case compactWidthE::width16:
+            memcpy(&value, cursor, 2);
+            cursor += 2;
+            break;
+
+          case compactWidthE::width32:
+            memcpy(&value, cursor, 4);
+            cursor += 4;
+            break;
+
+          default:
+            break;
+        }
+
+        return value;
+      }
+
+
+      uint32_t *scan(bool isDr, bool isReadWrite, uint32_t data, uint32_t *res) {
+        const uint32_t length = (isDr) ? drOpcodeLen : irOpcodeLen;
+
+#ifdef JTAG_IR_CACHE
+        if (!isDr) {
+          if (isReadWrite) {
+            tap::irCache::shifted(data, length);
+          } else if (tap::irCache::isHit(data, length)) {
+            tap::endStateMove(defaultEndState);
+            return res;
+          } else {
+            tap::irCache::update(data, length);
+          }
+        }
+#endif
+
+        uint32_t read = chain::scan((isDr) ? tap::stateE::ShiftDr : tap::stateE::ShiftIr, length, data, defaultEndState);
+
+        if (isReadWrite) {
+          res = appendRead(res, read, length);
+        }
+        return res;
+      }
+
+
+      requestAndResponse block(uint32_t *req, uint32_t *res) {
+        // Arguments in the stream are BYTES_COUNT (8-bit), and then BYTES_COUNT bytes of the opcodes and their arguments
+        const uint8_t *cursor = reinterpret_cast<const uint8_t *>(req);
+        const uint8_t *end    = cursor + 1 + *cursor;
+        const uint32_t words  = (1 + *cursor + 3) / 4;
+        cursor++;
+
+        if (words > requestLeft(req)) return reject(req, res, words);
+
+        // The read scans respond one word each, they are counted first so the block is executed whole or not at all
+        uint32_t reads = 0;
+        for (const uint8_t *peek = cursor; peek < end; ) {
+          const uint8_t opcode = *peek;
+          peek += 1 + argumentBytes(static_cast<compactWidthE>(opcode >> 6));
+
+          if (static_cast<compactE>(opcode & 0b0000'1111) == compactE::scan &&
+              (opcode & (1u << static_cast<uint8_t>(scanBitsE::isReadWrite)))) reads++;
+        }
+        if (reads > responseLeft(res)) return reject(req, res, words);
+
+        while (cursor < end) {
+          const uint8_t opcode = *cursor;
+          cursor++;
+
+          // An argument cut off by the end of the block is not read past it
+          const auto width = static_cast<compactWidthE>(opcode >> 6);
+          if (argumentBytes(width) > static_cast<uint32_t>(end - cursor)) break;
+
+          const auto     command  = static_cast<compactE>(opcode & 0b0000'1111);
+          const uint32_t argument = readArgument(cursor, width);
+
+          switch (command) {
+            case compactE::stateMove:
+              defaultEndState = static_cast<tap::stateE>(argument);
+              break;
+
+            case compactE::pathMove:
+              tap::stateMove(static_cast<tap::stateE>(argument));
+              break;
+
+            case compactE::runTest:
+              runIdle(argument);
+              break;
+
+            case compactE::setIrOpcodeLen:
+              irOpcodeLen = argument;
+              break;
+
+            case compactE::setDrOpcodeLen:
+              drOpcodeLen = argument;
+              break;
+
+            case compactE::scan:
+              res = scan(opcode & (1u << static_cast<uint8_t>(scanBitsE::isDr)),
+                         opcode & (1u << static_cast<uint8_t>(scanBitsE::isReadWrite)), argument, res);
+              break;
+
+            default:
+              break;
+          }
+        }
+
+        // Continue with the next whole word after the block
+        req += words;
         return JTAG_COMBINE_REQ_RES(req, res);
       }
 
@@ -204,6 +1184,11 @@ namespace jtag {
           break;
         }
 
+        case commandE::tck: {
+          ret = tck<(COMMAND_ID & (1u << 4u)) != 0>(req, res);
+          break;
+        }
+
         case commandE::stateMove: {
           ret = stateMove(req, res);
           break;
@@ -243,6 +1228,117 @@ namespace jtag {
           break;
         }
 
+        case commandE::scanLong: {
+          const uint32_t scanVariation = COMMAND_ID & 0b1111'0000;
+
+          const auto isDr           = static_cast<scan::captureE>(scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isDr)));
+          const auto isReadWrite    = static_cast<scan::accessE>( scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isReadWrite)));
+
+          if (scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isFill))) {
+            ret = scan::fill<isDr, isReadWrite>(req, res);
+          } else {
+            ret = scan::buffer<isDr, isReadWrite>(req, res);
+          }
+          break;
+        }
+
+        case commandE::scanIrDr: {
+          const uint32_t scanVariation = COMMAND_ID & 0b1111'0000;
+
+          const auto isReadWrite    = static_cast<scan::accessE>(      scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isReadWrite)));
+          const auto isLenOpcode    = static_cast<scan::opcodeLengthE>(scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isLenArgument)));
+
+          ret = scan::irThenDr<isReadWrite, isLenOpcode>(req, res);
+          break;
+        }
+
+        case commandE::scanPoll: {
+          const uint32_t scanVariation = COMMAND_ID & 0b1111'0000;
+
+          const auto isDr           = static_cast<scan::captureE>(     scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isDr)));
+          const auto isLenOpcode    = static_cast<scan::opcodeLengthE>(scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isLenArgument)));
+
+          ret = scan::poll<isDr, isLenOpcode>(req, res);
+          break;
+        }
+
+        case commandE::scanCompare: {
+          const uint32_t scanVariation = COMMAND_ID & 0b1111'0000;
+
+          const auto isDr           = static_cast<scan::captureE>(     scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isDr)));
+          const auto isLenOpcode    = static_cast<scan::opcodeLengthE>(scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isLenArgument)));
+
+          if (scanVariation & (1u << static_cast<uint8_t>(scanBitsE::isLenOver32))) {
+            ret = scan::compareBuffer<isDr>(req, res);
+          } else {
+            ret = scan::compare<isDr, isLenOpcode>(req, res);
+          }
+          break;
+        }
+
+        case commandE::extended: {
+          // The higher 4-bits select the extended command
+          const auto extendedId = static_cast<extendedE>(COMMAND_ID >> 4);
+
+          switch (extendedId) {
+            case extendedE::responseFormat: {
+              ret = responseFormat(req, res);
+              break;
+            }
+
+            case extendedE::compact: {
+              ret = compact::block(req, res);
+              break;
+            }
+
+            case extendedE::vector: {
+              ret = vector(req, res);
+              break;
+            }
+
+            case extendedE::chainSetup: {
+              ret = chainSetup(req, res);
+              break;
+            }
+
+            case extendedE::chainSelect: {
+              ret = chainSelect(req, res);
+              break;
+            }
+
+            case extendedE::chainScan: {
+              ret = chainScan(req, res);
+              break;
+            }
+
+            case extendedE::gangScan: {
+              ret = gangScan(req, res);
+              break;
+            }
+
+            case extendedE::waveform: {
+              ret = waveformSetup(req, res);
+              break;
+            }
+
+            case extendedE::spi: {
+              ret = spiSetup(req, res);
+              break;
+            }
+
+            case extendedE::irqChunk: {
+              ret = irqChunk(req, res);
+              break;
+            }
+
+            default: {
+              ret = failure(req, res);
+              break;
+            }
+          }
+          break;
+        }
+
         default: {
           // All invalid or unimplemented calls will cause failure
           ret = failure(req, res);
@@ -272,6 +1368,53 @@ namespace jtag {
 
     const std::array<commandHandler, 256> handlers = populateApiTable<0>();
 
+
+#ifdef JTAG_USB_THREADED_DISPATCH
+
+    // Without the tail jump every command of a group would nest one stack frame deeper. GCC 15+ can be
+    // forced to do it with the musttail, the older ones do it only as the sibling call optimisation
+    // (-foptimize-sibling-calls, enabled from -O2/-Os), the unoptimised builds have the dispatch disabled (jtag_global.h)
+#ifdef JTAG_HAS_MUSTTAIL
+#define JTAG_TAIL_CALL [[gnu::musttail]]
+#else
+#define JTAG_TAIL_CALL
+#endif
+
+    template<uint8_t COMMAND_ID>
+    __attribute__((optimize("-Ofast")))
+    requestAndResponse threaded(uint32_t *req, uint32_t *res, uint32_t commandIds) {
+      // The apiSwitch gets inlined, then instead of returning back to the parseQueue loop the
+      // next handler is invoked directly. The call is the last thing done with the same
+      // R0/R1 (req/res) + R2 (commandIds) arguments, so it's a tail jump (see the JTAG_TAIL_CALL)
+      requestAndResponse combined = apiSwitch<COMMAND_ID>(req, res);
+      JTAG_DECOMPOSE_REQ_RES(combined, req, res);
+
+      if (commandIds == 0) return JTAG_COMBINE_REQ_RES(req, res);
+
+      JTAG_TAIL_CALL return threadedHandlers[commandIds & 0xff](req, res, commandIds >> 8);
+    }
+
+
+    template <uint32_t lookupIndex>
+    constexpr std::array<threadedCommandHandler, 256> populateThreadedTable() {
+        auto result = populateThreadedTable<lookupIndex + 1>();
+        result[lookupIndex] = threaded<lookupIndex>;
+
+        return result;
+    }
+
+
+    template <>
+    constexpr std::array<threadedCommandHandler, 256> populateThreadedTable<256>() {
+        std::array<threadedCommandHandler, 256> lookupTable = { nullptr };
+        return lookupTable;
+    }
+
+
+    const std::array<threadedCommandHandler, 256> threadedHandlers = populateThreadedTable<0>();
+
+#endif
+
   }
 }
 
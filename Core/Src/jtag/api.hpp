@@ -24,12 +24,21 @@ namespace jtag {
 
     extern const std::array<commandHandler, 256> handlers;
 
+#ifdef JTAG_USB_THREADED_DISPATCH
+    extern const std::array<threadedCommandHandler, 256> threadedHandlers;
+#endif
+
+    void batchStart(uint32_t *requestEnd, uint32_t *responseEnd);
+
+    bool batchRejected(void);
+
 
     enum class scanBitsE:uint8_t {
       isReadWrite   = 4,
       isDr          = 5,
       isLenArgument = 6,
-      isLenOver32   = 7
+      isLenOver32   = 7,
+      isFill        = isLenArgument   // alias, the scanLong has no length variants and uses the same bit for the constant fill
     };
 
 
@@ -39,7 +48,8 @@ namespace jtag {
       ping,           // respond back what version this FW is
       reset,          // trst or srst (bit 4 controls write/read, bit 5 to tell trst/srst and bit 6 to tell the state to write)
       led,            // get and set TCK speed (bit 4 controls write/read)
-      tck,            // get and set TCK speed (bit 4 controls write/read)
+      tck,            // get and set TCK speed (bit 4 controls write/read), write takes frequency in Hz, both respond with frequency and duty (0.1% units)
+                      // of the TCK of all the scans and moves (the first and the last TCK of a scan can be stretched by its setup)
 
       stateMove,      // Specify endState after commands (don't change TAP SM)
       pathMove,       // move current state to the end-state (change TAP SM)
@@ -76,15 +86,193 @@ namespace jtag {
       // Write DR,          2 arguments void     (uint32_t len, uint64_t data) => (endState is global), 64 >= len > 32
       // Read and write DR, 2 arguments uint64_t (uint32_t len, uint64_t data) => (endState is global), 64 >= len > 32
 
+      // The uint64_t data are transfered as two words (lower word first) and shifted with a single dedicated 64-bit kernel,
+      // other lengths than 64 >= len > 32 are not shifted at all (and nothing is responded)
+
       // 3 argument scans shouldn't be needed as changing the endState on each scan is unlikely
       // and even if it would happen, the existing commands can achieve the same with just 1 word overhead
 
+      scanLong,       // scan of any length, data are packed words streamed after the length argument
+
+      // Permutations of the bits for the scanLong command (same positions as in the scan command):
+
+      // 4bit - Write/Read+Write
+      // 5bit - IR/DR scan
+      // 6bit - Data words / Constant fill (single FILL argument, 0 or 1, shifted to all the bits)
+
+      // Write IR,          void                 (uint32_t len, uint32_t data[(len+31)/32]) => (endState is global)
+      // Read and write IR, uint32_t[(len+31)/32] (uint32_t len, uint32_t data[(len+31)/32]) => (endState is global)
+      // Write DR,          void                 (uint32_t len, uint32_t data[(len+31)/32]) => (endState is global)
+      // Read and write DR, uint32_t[(len+31)/32] (uint32_t len, uint32_t data[(len+31)/32]) => (endState is global)
+
+      // Fill IR,           void                 (uint32_t len, uint32_t fill) => (endState is global)
+      // Fill and read IR,  uint32_t[(len+31)/32] (uint32_t len, uint32_t fill) => (endState is global)
+      // Fill DR,           void                 (uint32_t len, uint32_t fill) => (endState is global)
+      // Fill and read DR,  uint32_t[(len+31)/32] (uint32_t len, uint32_t fill) => (endState is global)
+      // The data words have to be inside the same batch (USB transfer or joined HID frames) and the read ones
+      // have to fit into the response buffer of the batch (together with the responses before them), otherwise
+      // the scan is rejected: nothing is shifted or responded, and the batch reports it (the rejected HID flag)
+
+      scanIrDr,       // IR scan followed directly by a DR scan (Exit1IR -> UpdateIR -> SelectDR -> CaptureDR -> ShiftDR without visiting RunTestIdle)
+
+      // Permutations of the bits for the scanIrDr command:
+
+      // 4bit - Write DR / Read+Write DR (the IR is always write only)
+      // 6bit - OpCodeLens Global / Arguments
+
+      // Write IR + write DR,          void     (uint32_t irData, uint32_t drData) => (lens and endState are global)
+      // Write IR + read and write DR, uint32_t (uint32_t irData, uint32_t drData) => (lens and endState are global)
+      // Write IR + write DR,          void     (uint32_t irData, uint32_t drData, uint32_t irLen, uint32_t drLen) => (endState is global)
+      // Write IR + read and write DR, uint32_t (uint32_t irData, uint32_t drData, uint32_t irLen, uint32_t drLen) => (endState is global)
+
+      scanPoll,       // repeat the same scan until (TDO & mask) == value, or until the attempts run out
+
+      // Permutations of the bits for the scanPoll command (same positions as in the scan command):
+
+      // 5bit - IR/DR scan
+      // 6bit - OpCodeLen Global / Argument
+
+      // Poll IR, uint32_t read, uint32_t attempts (uint32_t data, uint32_t mask, uint32_t value, uint32_t maxAttempts, uint32_t idleCycles) => (len and endState are global)
+      // Poll DR, uint32_t read, uint32_t attempts (uint32_t data, uint32_t mask, uint32_t value, uint32_t maxAttempts, uint32_t idleCycles) => (len and endState are global)
+      // Poll IR, uint32_t read, uint32_t attempts (uint32_t data, uint32_t mask, uint32_t value, uint32_t maxAttempts, uint32_t idleCycles, uint32_t len) => (endState is global)
+      // Poll DR, uint32_t read, uint32_t attempts (uint32_t data, uint32_t mask, uint32_t value, uint32_t maxAttempts, uint32_t idleCycles, uint32_t len) => (endState is global)
+
+      // Between the attempts the TAP spends idleCycles in the RunTestIdle (0 = no idle), the response is the last
+      // captured value and the number of attempts taken, all up to len <= 32 only
+
+      scanCompare,    // scan and compare the captured TDO against expected value on the device, respond only the mismatches
+
+      // Permutations of the bits for the scanCompare command:
+
+      // 5bit - IR/DR scan
+      // 6bit - OpCodeLen Global / Argument (only for len <= 32)
+      // 7bit - len <= 32 / Long scan of any length (like the scanLong)
+
+      // Compare IR,      void or mismatch (uint32_t data, uint32_t expected, uint32_t mask) => (len and endState are global)
+      // Compare DR,      void or mismatch (uint32_t data, uint32_t expected, uint32_t mask) => (len and endState are global)
+      // Compare IR,      void or mismatch (uint32_t data, uint32_t expected, uint32_t mask, uint32_t len) => (endState is global)
+      // Compare DR,      void or mismatch (uint32_t data, uint32_t expected, uint32_t mask, uint32_t len) => (endState is global)
+      // Compare long IR, void or mismatches (uint32_t len, uint32_t data[w], uint32_t expected[w], uint32_t mask[w]) => (endState is global), w = (len+31)/32
+      // Compare long DR, void or mismatches (uint32_t len, uint32_t data[w], uint32_t expected[w], uint32_t mask[w]) => (endState is global), w = (len+31)/32
+
+      // Matching scan doesn't respond anything, each mismatching word responds a record of two words: index and
+      // the captured word. The index has in the lower 16-bits the order of the compare command within the batch
+      // (counted from 0) and in the upper 16-bits the word offset within the long scan (0 for the short ones)
+      // The long compare is rejected (like the scanLong) when its words go past the batch, or when the response
+      // buffer of the batch has no space left for all its words mismatching
+
+      extended,       // the higher 4-bits select one of the extendedE commands
+
+      last_enum
+    };
+
+
+    enum class extendedE:uint8_t {
+      responseFormat, // (uint32_t packed) 0 = each read scan responds whole words, 1 = reads are packed bit-contiguously
+
+      // In the packed format the scan, scanIrDr responses (up to 64-bits) are appended right after the bits of
+      // the previous packed read, the host unpacks them with the lengths it knows. A response of any other
+      // command is still word aligned and the next packed read after it starts at a fresh word again.
+      // Each batch starts at a fresh word.
+
+      compact,        // block of byte-encoded commands with narrow arguments, see the compactE
+
+      vector,         // uint32_t tdo[w] (uint32_t len, uint32_t tms[w], uint32_t tdi[w]), w = (len+31)/32
+
+      // Raw TMS and TDI bit vectors shifted in lockstep (bit 0 of the first word first) and the TDO is always
+      // captured. Meant for bridges (XVC, OpenOCD's TMS sequences) which drive the state machine on their own.
+      // Rejected (like the scanLong) when the vectors go past the batch or the TDO words don't fit its response buffer.
+
+      chainSetup,     // uint32_t mismatches (uint32_t count, {uint32_t irLen, uint32_t idcode}[count])
+
+      // Describes the TAPs daisy-chained on the JTAG, position 0 is the TAP closest to the TDO. The idcode 0
+      // means the TAP has no IDCODE register. The chain is verified by reading the DRs after the TAP reset,
+      // each bit set in the response is a position which didn't match. The position 0 becomes active.
+      // A description with more than JTAG_CHAIN_MAX_TAPS or an irLen outside of 1-32 is ignored (all bits set).
+
+      chainSelect,    // (uint32_t index)
+
+      // Makes the TAP at the index active, its IR length replaces the setIrOpcodeLen. All the other TAPs
+      // stay in the BYPASS, every scan shifts their padding (IR all ones, 1 DR bit each) around the data
+      // and the padding is stripped from the responded reads (and from the scanCompare word offsets).
+      // The vector command is raw and never padded.
+
+      chainScan,      // uint32_t dr[n] ({uint32_t ir, uint32_t drLen, uint32_t dr}[n]), n = TAPs in the chainSetup
+
+      // Scans every TAP of the chain at once, each position gets its own instruction and data (up to 32 bits),
+      // drLen 0 keeps the TAP in the BYPASS. All the IRs are shifted in one pass, then all the DRs in another,
+      // so multiple cores can be halted/resumed on the same TCK edge. Responds one DR read per position.
+      // Any drLen over 32, or the arguments going past the batch or the reads not fitting its response buffer,
+      // rejects the whole command, nothing is shifted or responded (the rejected HID flag).
+
+      gangScan,       // uint8_t tdo[len] (uint32_t isDr, uint32_t len, uint8_t tdi[len]), the slices are padded to whole words
+
+      // Shifts the JTAG_GANG chains at once (shared TCK/TMS), each byte is one TCK with the bit N for the chain N.
+      // The captured TDO slices are in the same layout, so the host can tell which board failed. Needs a build
+      // with the JTAG_GANG enabled, otherwise the slices are skipped and nothing is responded. The len 0, or the
+      // slices going past the batch or not fitting its response buffer reject the command (the rejected HID flag).
+
+      waveform,       // uint32_t maxFrequency (uint32_t threshold)
+
+      // Selects the TIM1 + DMA2 waveform backend for the scanLong buffers of threshold bits or longer (0 disables
+      // it). It calibrates the fastest TCK the DMA sustains (the TAP is moved to the RunTestIdle for it) and
+      // responds it in Hz, 0 when the backend is not usable or the JTAG_WAVEFORM is not built in. The scans
+      // then follow the tck speed, capped at this maximum. The IRQs stay enabled while the scan is on the wire.
+
+      spi,            // uint32_t frequency (uint32_t threshold, uint32_t frequency)
+
+      // Selects the SPI4 + DMA2 backend for the scanLong buffers of threshold bits or longer (0 disables it),
+      // their whole bytes are shifted by the SPI at the fastest prescaler not exceeding the frequency, the
+      // last partial byte by the bit-bang kernel. Responds the SPI clock (PCLK2 / prescaler) in Hz, 0 when the JTAG_SPI is
+      // not built in (it needs the JTAG_SPI_PINOUT daughter board). Takes precedence over the waveform.
+
+      irqChunk,       // uint32_t windowCycles (uint32_t words)
+
+      // Sets how many words (32 TCKs each) the scanLong buffers, vectors, gang scans and runTest idles shift with the IRQs
+      // disabled (0 = whole shift at once), between the chunks the TCK is held high and the USB IRQs get serviced.
+      // Responds the longest IRQ-disabled window in DWT cycles measured since the previous irqChunk (needs the
+      // JTAG_IRQ_LATENCY, otherwise 0), the window is the worst-case latency an IRQ waits for.
+
       last_enum
     };
 
 
+    // The compact block starts with a byte telling how many bytes of the commands follow (up to 255), then each
+    // command is one opcode byte followed by its little-endian argument of the selected width. After the block
+    // the request stream continues from the next word boundary. The full-width commands are not affected.
+    // A block which goes past the batch, or whose reads don't fit into the response, is rejected as a whole,
+    // an opcode whose argument is cut off by the end of the block ends it.
+    //
+    // Opcode byte:
+    // 0-3bit - compactE command
+    // 4bit   - Write/Read+Write (scan only, same position as in the scan command)
+    // 5bit   - IR/DR scan (scan only, same position as in the scan command)
+    // 6-7bit - argument width compactWidthE
+    enum class compactE:uint8_t {
+      nop,            // no argument
+      stateMove,      // endState
+      pathMove,       // endState
+      runTest,        // count
+      setIrOpcodeLen, // length (max 32bits)
+      setDrOpcodeLen, // length (max 32bits)
+      scan,           // data, lengths and the endState are global (len <= 32), responds as the scan command does
+
+      last_enum
+    };
+
+
+    enum class compactWidthE:uint8_t {
+      width8  = 0,
+      width16 = 1,
+      width32 = 2,
+      none    = 3     // no argument at all
+    };
+
+
     constexpr uint32_t api_e_size = static_cast<uint32_t>(commandE::last_enum);
 
+    static_assert(api_e_size <= (1u << 4u), "Command is selected by the lower 4-bits of the ID, the higher 4-bits are for the command variations");
+
     static_assert((api_e_size + (1u << 4u))<= 256u, "All API calls need to leave enough space for 4-bits (16 combinations) of SCAN commands");
 
 
@@ -7,26 +7,51 @@
  */
 
 #include <cstdint>
+#include <cstdio>
 #include <array>
+#include <algorithm>
 
 #include "bitbang.hpp"
 
 #include "main.h"
 #include "jtag_global.h"
 
+#ifdef JTAG_IRQ_CHUNK_BENCHMARK
+#include "stm32f429i_discovery_lcd.h"
+#endif
+
 namespace jtag {
 
   namespace bitbang {
 
+#ifdef JTAG_SPI_PINOUT
+    // TCK, TDO and TDI are on the SPI4 SCK, MISO and MOSI pins (see JTAG_SPI_PINOUT)
+    const uint8_t PIN_E_TCK   = 2;  // Test Clock
+    const uint8_t PIN_E_TMS   = 3;  // Test Mode Select
+    const uint8_t PIN_E_nTRST = 4;  // negated TAP Reset
+    const uint8_t PIN_E_TDO   = 5;  // Test Data Out (from the TAP perspective). Reading from the target (from host perspective)
+    const uint8_t PIN_E_TDI   = 6;  // Test Data In  (from the TAP perspective). Writing to the target   (from host perspective)
+#else
     const uint8_t PIN_E_TMS   = 2;  // Test Mode Select
     const uint8_t PIN_E_TCK   = 3;  // Test Clock
     const uint8_t PIN_E_TDI   = 4;  // Test Data In  (from the TAP perspective). Writing to the target   (from host perspective)
     const uint8_t PIN_E_nTRST = 5;  // negated TAP Reset
     const uint8_t PIN_E_TDO   = 6;  // Test Data Out (from the TAP perspective). Reading from the target (from host perspective)
+#endif
 
     const uint8_t PIN_C_VJTAG = 13;
     const uint8_t PIN_C_nSRST = 14; // negated System Reset
 
+    // How many words (32 TCKs each) the buffer, vector, idle and gang kernels clock before the IRQs are allowed to be
+    // serviced, 0 = whole shift in one IRQ-disabled window. Between the chunks the TCK is held high, no edge
+    // is made until the next chunk starts, so the TAP just waits (JTAG is static). The TMS, fused and 64-bit
+    // kernels are not chunked, they are bounded to at most 64 data bits (plus the TMS paths) by their callers
+    uint32_t irqChunkWords = JTAG_IRQ_CHUNK_WORDS;
+
+#ifdef JTAG_IRQ_LATENCY
+    uint32_t irqWindowMax  = 0;     // The longest IRQ-disabled kernel invocation (DWT cycles) since the last irqChunk call
+#endif
+
 
     template<uint8_t number>
     constexpr uint8_t powerOfTwo() {
@@ -36,10 +61,21 @@ namespace jtag {
     }
 
 
-    template<uint8_t WHAT_SIGNAL, uint8_t nTRSTvalue>
+    // Extra NOPs inserted into the low and high part of the TCK by the kernels, used to slow down the TCK (see tckSet)
+#define JTAG_DELAY_LOW_PART  ".rept    %c[delayLow]                                                               \n\t" \
+                             "nop                                                                               \n\t" \
+                             ".endr                                                                             \n\t"
+
+#define JTAG_DELAY_HIGH_PART ".rept    %c[delayHigh]                                                              \n\t" \
+                             "nop                                                                               \n\t" \
+                             ".endr                                                                             \n\t"
+
+
+    template<uint8_t WHAT_SIGNAL, uint8_t nTRSTvalue, uint32_t DELAY_HIGH, uint32_t DELAY_LOW>
     __attribute__((optimize("-Ofast")))
     uint32_t shiftAsmUltraSpeed(const uint32_t length, uint32_t writeValue) {
       // This has 9.363MHz TCK at 50% duty cycle (removing the NOPs below can make it slightly faster and with duty 48% or below)
+      // when DELAY_HIGH and DELAY_LOW are 0, each of them adds extra NOP cycles to its part of the TCK
       uint32_t addressWrite = GPIOE_BASE + 0x14; // ODR register of GPIO port E
       uint32_t addressRead  = GPIOE_BASE + 0x10; // IDR register of GPIO port E
 
@@ -95,8 +131,10 @@ namespace jtag {
 
 
         // High part of the TCK + sample
+        JTAG_DELAY_LOW_PART
         "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue
         "subs.w  %[count],       #1                                                        \n\t"  // count--
+        JTAG_DELAY_HIGH_PART
         "nop                                                                               \n\t"  // balancing the high part of TCK to be 50% duty cycle
         "ldr.w   %[inValue],     [%[gpioInAddr]]                                           \n\t"  // inValue = GPIO
         "bne     repeatForEachBit%=                                                        \n\t"  // if (count != 0) then  repeatForEachBit
@@ -124,7 +162,9 @@ namespace jtag {
           [readShift]       "M"(PIN_E_TDO + 1),   // Shifting to left TDO bit to the 31th (MSB) bit can be achieved with TDO + 1 shift to the right
           [readMask]        "r"(readMask),        // Masking the 31th (MSB) bit as we are shifting it already
           [clock_mask]      "I"(powerOfTwo<PIN_E_TCK>()),
-          [resetValue]      "I"(nTRSTvalue << PIN_E_nTRST)
+          [resetValue]      "I"(nTRSTvalue << PIN_E_nTRST),
+          [delayHigh]       "n"(DELAY_HIGH),
+          [delayLow]        "n"(DELAY_LOW)
 
         // Clobbers
         : "memory"
@@ -137,27 +177,942 @@ namespace jtag {
     }
 
 
+    template<uint8_t nTRSTvalue, uint32_t DELAY_HIGH, uint32_t DELAY_LOW>
+    __attribute__((optimize("-Ofast")))
+    uint32_t shiftAsmFused(uint32_t entryCount, uint32_t entryValue, const uint32_t length, uint32_t writeValue, uint32_t exitCount, uint32_t exitValue) {
+      // Entry TMS path, TDI data and exit TMS path inside one critical section. The last data bit
+      // is shifted together with the first TMS bit of the exit path (exitValue bit0), the exitCount
+      // is the amount of the remaining exit bits. The data loop has the same timing as the
+      // shiftAsmUltraSpeed, the BFI is used to insert bits into the outValue which keeps its
+      // other bits (nTRST, TMS) so the TMS and TDI can be controlled independently
+      uint32_t addressWrite = GPIOE_BASE + 0x14; // ODR register of GPIO port E (IDR is at the -4 offset from it)
+
+      uint32_t readMask     = (1 << 31);
+      uint32_t count        = length;
+      uint32_t outValue     = 0;
+      uint32_t outValueTck  = 0;
+      uint32_t inValue      = 0;
+      uint32_t retValue     = 0;
+
+      asm volatile (
+        "mov.w   %[outValue],    %[resetValue]                                             \n\t"  // outValue = (nRSTvlaue << nRST), TMS and TDI low
+
+        "cpsid if                                                                          \n\t"  // Disable IRQ temporary for critical moment
+
+        // Entry path, only TMS is shifted
+        "cmp.w   %[entryCount],  #0                                                        \n\t"
+        "beq     entryDone%=                                                               \n\t"
+        "entryLoop%=:                                                                      \n\t"
+        "bfi     %[outValue],    %[entryValue],     %[tmsPin],     #1                      \n\t"  // outValue.TMS = entryValue & 1
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue (TCK low)
+        "lsr.w   %[entryValue],  %[entryValue],     #1                                     \n\t"  // entryValue = entryValue >> 1
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"  // outValueTck = outValue | (1 << TCK)
+        "nop                                                                               \n\t"  // balancing to keep the same TCK period as the data loop
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValueTck (TCK high)
+        "subs.w  %[entryCount],  #1                                                        \n\t"  // entryCount--
+        JTAG_DELAY_HIGH_PART
+        "nop                                                                               \n\t"  // the two NOPs and the BFI on the loop start take the place of the NOP + LDR
+        "nop                                                                               \n\t"
+        "bne     entryLoop%=                                                               \n\t"  // if (entryCount != 0) then entryLoop
+        "entryDone%=:                                                                      \n\t"
+        "bfc     %[outValue],    %[tmsPin],         #1                                     \n\t"  // outValue.TMS = 0 while shifting the data
+
+        // Data, all bits except the last one (the loop is the same as in the shiftAsmUltraSpeed)
+        "bfi     %[outValue],    %[writeValue],     %[tdiPin],     #1                      \n\t"  // outValue.TDI = writeValue & 1
+        "subs.w  %[count],       #1                                                        \n\t"  // count-- (the last bit is not done inside the loop)
+        "beq     lastBit%=                                                                 \n\t"
+        "dataLoop%=:                                                                       \n\t"
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue (TCK low)
+        "and.w   %[inValue],     %[readMask],       %[inValue],    ror %[readShift]        \n\t"  // inValue = (inValue << (from TDO-bit to 31th-bit)) & ( 1 << 31)
+        "orr.w   %[retValue],    %[inValue],        %[retValue],   lsr #1                  \n\t"  // retValue = (retValue >> 1) | inValue
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"  // outValueTck = outValue | (1 << TCK)
+        "lsr.w   %[writeValue],  %[writeValue],     #1                                     \n\t"  // writeValue = writeValue >> 1
+        "bfi     %[outValue],    %[writeValue],     %[tdiPin],     #1                      \n\t"  // outValue.TDI = writeValue & 1
+        "nop                                                                               \n\t"  // BFI is one instruction instead of AND+ORR, keep the timing
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValueTck (TCK high)
+        "subs.w  %[count],       #1                                                        \n\t"  // count--
+        JTAG_DELAY_HIGH_PART
+        "nop                                                                               \n\t"  // balancing the high part of TCK to be 50% duty cycle
+        "ldr.w   %[inValue],     [%[gpioOutAddr], #-4]                                     \n\t"  // inValue = GPIO (IDR)
+        "bne     dataLoop%=                                                                \n\t"  // if (count != 0) then dataLoop
+
+        // Last data bit, with the first bit of the exit path on the TMS
+        "lastBit%=:                                                                        \n\t"
+        "bfi     %[outValue],    %[exitValue],      %[tmsPin],     #1                      \n\t"  // outValue.TMS = exitValue & 1
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue (TCK low)
+        "and.w   %[inValue],     %[readMask],       %[inValue],    ror %[readShift]        \n\t"
+        "orr.w   %[retValue],    %[inValue],        %[retValue],   lsr #1                  \n\t"
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"
+        "lsr.w   %[exitValue],   %[exitValue],      #1                                     \n\t"  // exitValue = exitValue >> 1
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValueTck (TCK high)
+        JTAG_DELAY_HIGH_PART
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "ldr.w   %[inValue],     [%[gpioOutAddr], #-4]                                     \n\t"  // inValue = GPIO (IDR)
+        "and.w   %[inValue],     %[readMask],       %[inValue],    ror %[readShift]        \n\t"  // Process the last inValue
+        "orr.w   %[retValue],    %[inValue],        %[retValue],   lsr #1                  \n\t"
+
+        // Rest of the exit path, only TMS is shifted
+        "cmp.w   %[exitCount],   #0                                                        \n\t"
+        "beq     exitDone%=                                                                \n\t"
+        "exitLoop%=:                                                                       \n\t"
+        "bfi     %[outValue],    %[exitValue],      %[tmsPin],     #1                      \n\t"  // outValue.TMS = exitValue & 1
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue (TCK low)
+        "lsr.w   %[exitValue],   %[exitValue],      #1                                     \n\t"  // exitValue = exitValue >> 1
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"  // outValueTck = outValue | (1 << TCK)
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValueTck (TCK high)
+        "subs.w  %[exitCount],   #1                                                        \n\t"  // exitCount--
+        JTAG_DELAY_HIGH_PART
+        "nop                                                                               \n\t"  // the two NOPs and the BFI on the loop start take the place of the NOP + LDR
+        "nop                                                                               \n\t"
+        "bne     exitLoop%=                                                                \n\t"  // if (exitCount != 0) then exitLoop
+        "exitDone%=:                                                                       \n\t"
+
+        "cpsie if                                                                          \n\t"  // Enable IRQ, the critical section finished
+
+        // Outputs
+        : [retValue]        "+r"(retValue),
+          [count]           "+r"(count),
+          [outValue]        "+r"(outValue),
+          [outValueTck]     "+r"(outValueTck),
+          [inValue]         "+r"(inValue),
+          [writeValue]      "+r"(writeValue),
+          [entryCount]      "+r"(entryCount),
+          [entryValue]      "+r"(entryValue),
+          [exitCount]       "+r"(exitCount),
+          [exitValue]       "+r"(exitValue)
+
+        // Inputs
+        : [gpioOutAddr]     "r"(addressWrite),
+          [readMask]        "r"(readMask),
+          [readShift]       "M"(PIN_E_TDO + 1),
+          [tmsPin]          "I"(PIN_E_TMS),
+          [tdiPin]          "I"(PIN_E_TDI),
+          [clock_mask]      "I"(powerOfTwo<PIN_E_TCK>()),
+          [resetValue]      "I"(nTRSTvalue << PIN_E_nTRST),
+          [delayHigh]       "n"(DELAY_HIGH),
+          [delayLow]        "n"(DELAY_LOW)
+
+        // Clobbers
+        : "memory", "cc"
+      );
+
+      // Shift the rest of bits as they were pushed from opposite direction
+      return retValue >> (32 - length);
+    }
+
+
+    template<uint8_t WHAT_SIGNAL, uint8_t nTRSTvalue, uint32_t DELAY_HIGH, uint32_t DELAY_LOW>
+    __attribute__((optimize("-Ofast")))
+    uint64_t shiftAsm64(const uint32_t length, const uint64_t writeValue) {
+      // Variant of the shiftAsmUltraSpeed for 32 < length <= 64, the 64-bit values are kept as register pairs
+      // and shifted through the carry, so all bits have the same timing and there is no word switching in
+      // the middle of the loop. The TDO bit is shifted out of the inValue into the carry (LSRS) and from there
+      // into the 64-bit ret (ADCS + ADC doubling it), the write is shifted with LSRS + RRX and inserted into
+      // the outValue with a BFI in place of the balancing NOP. That is 6 instructions in the low part and the
+      // same high part as the shiftAsmUltraSpeed has. The ret is collected from the other end and is reversed
+      // with the RBITs at the end.
+      uint32_t addressWrite = GPIOE_BASE + 0x14; // ODR register of GPIO port E (IDR is at the -4 offset from it)
+
+      uint32_t count        = length;
+      uint32_t outValue     = 0;
+      uint32_t outValueTck  = 0;
+      uint32_t inValue      = 0;
+      uint32_t retLow       = 0;
+      uint32_t retHigh      = 0;
+      uint32_t writeLow     = static_cast<uint32_t>(writeValue);
+      uint32_t writeHigh    = static_cast<uint32_t>(writeValue >> 32);
+
+      asm volatile (
+        "mov.w   %[outValue],    %[resetValue]                                             \n\t"  // outValue = (nRSTvlaue << nRST)
+        "bfi     %[outValue],    %[writeLow],       %[writePin],   #1                      \n\t"  // outValue.TDI/TMS = writeLow & 1
+
+        "cpsid if                                                                          \n\t"  // Disable IRQ temporary for critical moment
+
+        "repeatForEachBit%=:                                                               \n\t"
+
+        // Low part of the TCK
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue
+
+        // On first cycle this is redundant, it's shifting a zero which gets dropped at the end
+        "lsrs.w  %[inValue],     %[inValue],        %[readShift]                           \n\t"  // carry = TDO bit of the inValue
+        "adcs.w  %[retLow],      %[retLow],         %[retLow]                              \n\t"  // ret = (ret << 1) | carry (64-bit, the MSB of the
+        "adc.w   %[retHigh],     %[retHigh],        %[retHigh]                             \n\t"  //                             low half goes to the high half)
+
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"  // outValue = outValue | (1 << TCK) - setting TCK high
+        "lsrs.w  %[writeHigh],   %[writeHigh],      #1                                     \n\t"  // write = write >> 1 (64-bit)
+        "rrx     %[writeLow],    %[writeLow]                                               \n\t"
+
+        // High part of the TCK + sample
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue
+        "subs.w  %[count],       #1                                                        \n\t"  // count--
+        JTAG_DELAY_HIGH_PART
+        "bfi     %[outValue],    %[writeLow],       %[writePin],   #1                      \n\t"  // outValue.TDI/TMS = writeLow & 1 (for the next bit, doesn't touch the flags)
+        "ldr.w   %[inValue],     [%[gpioOutAddr], #-4]                                     \n\t"  // inValue = GPIO (IDR)
+        "bne     repeatForEachBit%=                                                        \n\t"  // if (count != 0) then  repeatForEachBit
+
+        "cpsie if                                                                          \n\t"  // Enable IRQ, the critical section finished
+
+        // Process the last inValue and reverse the ret, so the first captured bit will end up as the LSB
+        "lsrs.w  %[inValue],     %[inValue],        %[readShift]                           \n\t"
+        "adcs.w  %[retLow],      %[retLow],         %[retLow]                              \n\t"
+        "adc.w   %[retHigh],     %[retHigh],        %[retHigh]                             \n\t"
+        "rbit    %[retLow],      %[retLow]                                                 \n\t"
+        "rbit    %[retHigh],     %[retHigh]                                                \n\t"
+
+        // Outputs
+        : [retLow]          "+r"(retLow),
+          [retHigh]         "+r"(retHigh),
+          [count]           "+r"(count),
+          [outValue]        "+r"(outValue),
+          [outValueTck]     "+r"(outValueTck),
+          [inValue]         "+r"(inValue),
+          [writeLow]        "+r"(writeLow),
+          [writeHigh]       "+r"(writeHigh)
+
+        // Inputs
+        : [gpioOutAddr]     "r"(addressWrite),
+          [writePin]        "I"(WHAT_SIGNAL),
+          [readShift]       "M"(PIN_E_TDO + 1),     // The TDO bit is the last one shifted out, into the carry
+          [clock_mask]      "I"(powerOfTwo<PIN_E_TCK>()),
+          [resetValue]      "I"(nTRSTvalue << PIN_E_nTRST),
+          [delayHigh]       "n"(DELAY_HIGH),
+          [delayLow]        "n"(DELAY_LOW)
+
+        // Clobbers
+        : "memory", "cc"
+      );
+
+      // The reversed low half holds the first captured bits, shift the rest of bits as they were pushed from opposite direction
+      uint64_t retValue = (static_cast<uint64_t>(retLow) << 32) | retHigh;
+      return retValue >> (64 - length);
+    }
+
+
+    template<uint8_t WHAT_SIGNAL, uint8_t nTRSTvalue, uint32_t DELAY_HIGH, uint32_t DELAY_LOW, uint32_t WRITE_STRIDE>
+    __attribute__((optimize("-Ofast")))
+    void shiftAsmBuffer(const uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer, const uint32_t readStride) {
+      // Same bit timing as shiftAsmUltraSpeed, but walks through whole buffer of words inside one critical section.
+      // Between the words the TCK is kept high a little bit longer, while the next word is loaded and the
+      // captured word is stored, which is harmless as the TAP is sampling on the rising edge only.
+      // When readStride is 0, then all captured words are written over the same location (used for write-only scans)
+      // When WRITE_STRIDE is 0, then the same word is shifted over and over (used for the constant fill scans)
+      uint32_t addressWrite = GPIOE_BASE + 0x14; // ODR register of GPIO port E (IDR is at the -4 offset from it)
+
+      uint32_t writeMask    = (1 << WHAT_SIGNAL);
+      uint32_t readMask     = (1 << 31); // Masking the 31th (MSB) bit as we are shifting it already
+      uint32_t count        = length;    // How many bits are left to be processed in total
+      uint32_t bits         = 0;         // How many bits are left to be processed in the current word
+      uint32_t outValue     = 0;
+      uint32_t outValueTck  = 0;
+      uint32_t inValue      = 0;
+      uint32_t retValue     = 0;
+      uint32_t writeValue   = 0;
+
+      asm volatile (
+        "cpsid if                                                                          \n\t"  // Disable IRQ temporary for critical moment
+
+        "repeatForEachWord%=:                                                              \n\t"
+        "ldr.w   %[writeValue],  [%[writePtr]],     %[writeStride]                         \n\t"  // writeValue = *writePtr; writePtr += WRITE_STRIDE
+        "cmp.w   %[count],       #32                                                       \n\t"
+        "ite     hi                                                                        \n\t"
+        "movhi   %[bits],        #32                                                       \n\t"  // bits = (count > 32) ? 32 : count
+        "movls   %[bits],        %[count]                                                  \n\t"
+        "sub.w   %[count],       %[count],          %[bits]                                \n\t"  // count = count - bits
+        "mov.w   %[inValue],     #0                                                        \n\t"  // Make the first (redundant) processing of the inValue harmless
+        "mov.w   %[retValue],    #0                                                        \n\t"
+
+        // Pre-load output register before we start the bit loop
+        "and.w   %[outValue],    %[writeMask],      %[writeValue], ror %[writeShiftRight]  \n\t"  // outValue = (writeValue << TDI/TMS) &  (1 << TDI/TMS-Offset)
+        "orr.w   %[outValue],    %[outValue],       %[resetValue]                          \n\t"  // outValue = outValue | (nRSTvlaue << nRST)
+
+        // The bit loop is identical to the shiftAsmUltraSpeed, see the comments there
+        "repeatForEachBit%=:                                                               \n\t"
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue
+        "and.w   %[inValue],     %[readMask],       %[inValue],    ror %[readShift]        \n\t"  // inValue = (inValue << (from TDO-bit to 31th-bit)) & ( 1 << 31)
+        "orr.w   %[retValue],    %[inValue],        %[retValue],   lsr #1                  \n\t"  // retValue = (retValue >> 1) | inValue
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"  // outValue = outValue | (1 << TCK) - setting TCK high
+        "lsr.w   %[writeValue],  %[writeValue],     #1                                     \n\t"  // writeValue = writeValue >> 1
+        "and.w   %[outValue],    %[writeMask],      %[writeValue], ror %[writeShiftRight]  \n\t"  // outValue = (writeValue << TDI/TMS) &  (1 << TDI/TMS-Offset)
+        "orr.w   %[outValue],    %[outValue],       %[resetValue]                          \n\t"  // outValue = outValue | (nRSTvlaue << nRST)
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue
+        "subs.w  %[bits],        #1                                                        \n\t"  // bits--
+        JTAG_DELAY_HIGH_PART
+        "nop                                                                               \n\t"  // balancing the high part of TCK to be 50% duty cycle
+        "ldr.w   %[inValue],     [%[gpioOutAddr], #-4]                                     \n\t"  // inValue = GPIO (IDR)
+        "bne     repeatForEachBit%=                                                        \n\t"  // if (bits != 0) then  repeatForEachBit
+
+        // Word finished, process the last inValue and store the captured word
+        "and.w   %[inValue],     %[readMask],       %[inValue],    ror %[readShift]        \n\t"  // inValue = (inValue << (from TDO-bit to 31th-bit)) & ( 1 << 31)
+        "orr.w   %[retValue],    %[inValue],        %[retValue],   lsr #1                  \n\t"  // retValue = (retValue >> 1) | inValue
+        "str.w   %[retValue],    [%[readPtr]]                                              \n\t"  // *readPtr = retValue
+        "add.w   %[readPtr],     %[readPtr],        %[readStride]                          \n\t"  // readPtr += readStride
+        "cmp.w   %[count],       #0                                                        \n\t"
+        "bne     repeatForEachWord%=                                                       \n\t"  // if (count != 0) then  repeatForEachWord
+
+        "cpsie if                                                                          \n\t"  // Enable IRQ, the critical section finished
+
+        // Outputs
+        : [retValue]        "+r"(retValue),
+          [count]           "+r"(count),
+          [bits]            "+r"(bits),
+          [outValue]        "+r"(outValue),
+          [outValueTck]     "+r"(outValueTck),
+          [inValue]         "+r"(inValue),
+          [writeValue]      "+r"(writeValue),
+          [writePtr]        "+r"(writeBuffer),
+          [readPtr]         "+r"(readBuffer)
+
+        // Inputs
+        : [gpioOutAddr]     "r"(addressWrite),
+          [writeMask]       "r"(writeMask),
+          [readStride]      "r"(readStride),
+          [writeStride]     "I"(WRITE_STRIDE),
+          [writeShiftRight] "M"(32-WHAT_SIGNAL),
+          [readShift]       "M"(PIN_E_TDO + 1),
+          [readMask]        "r"(readMask),
+          [clock_mask]      "I"(powerOfTwo<PIN_E_TCK>()),
+          [resetValue]      "I"(nTRSTvalue << PIN_E_nTRST),
+          [delayHigh]       "n"(DELAY_HIGH),
+          [delayLow]        "n"(DELAY_LOW)
+
+        // Clobbers
+        : "memory", "cc"
+      );
+    }
+
+
+    template<uint8_t nTRSTvalue, uint32_t DELAY_HIGH, uint32_t DELAY_LOW>
+    __attribute__((optimize("-Ofast")))
+    void shiftAsmVector(const uint32_t length, const uint32_t *tmsBuffer, const uint32_t *tdiBuffer, uint32_t *readBuffer) {
+      // Arbitrary TMS and TDI vectors are shifted in lockstep and the TDO is always captured. The word handling
+      // is the same as in the shiftAsmBuffer and the bit loop is the same as the data loop of the shiftAsmFused,
+      // the second BFI (TMS) takes the place of its NOP. The TMS word is shifted one bit ahead, in the high
+      // part of the TCK instead of the balancing NOP, so both parts of the TCK keep the same cycle count
+      uint32_t addressWrite = GPIOE_BASE + 0x14; // ODR register of GPIO port E (IDR is at the -4 offset from it)
+
+      uint32_t readMask     = (1 << 31);
+      uint32_t count        = length;    // How many bits are left to be processed in total
+      uint32_t bits         = 0;         // How many bits are left to be processed in the current word
+      uint32_t outValue     = 0;
+      uint32_t outValueTck  = 0;
+      uint32_t inValue      = 0;
+      uint32_t retValue     = 0;
+      uint32_t tmsValue     = 0;
+      uint32_t tdiValue     = 0;
+
+      asm volatile (
+        "cpsid if                                                                          \n\t"  // Disable IRQ temporary for critical moment
+
+        "repeatForEachWord%=:                                                              \n\t"
+        "ldr.w   %[tdiValue],    [%[tdiPtr]],       #4                                     \n\t"  // tdiValue = *tdiPtr++
+        "ldr.w   %[tmsValue],    [%[tmsPtr]],       #4                                     \n\t"  // tmsValue = *tmsPtr++
+        "cmp.w   %[count],       #32                                                       \n\t"
+        "ite     hi                                                                        \n\t"
+        "movhi   %[bits],        #32                                                       \n\t"  // bits = (count > 32) ? 32 : count
+        "movls   %[bits],        %[count]                                                  \n\t"
+        "sub.w   %[count],       %[count],          %[bits]                                \n\t"  // count = count - bits
+        "mov.w   %[inValue],     #0                                                        \n\t"  // Make the first (redundant) processing of the inValue harmless
+        "mov.w   %[retValue],    #0                                                        \n\t"
+
+        // Pre-load output register before we start the bit loop
+        "mov.w   %[outValue],    %[resetValue]                                             \n\t"  // outValue = (nRSTvlaue << nRST)
+        "bfi     %[outValue],    %[tdiValue],       %[tdiPin],     #1                      \n\t"  // outValue.TDI = tdiValue & 1
+        "bfi     %[outValue],    %[tmsValue],       %[tmsPin],     #1                      \n\t"  // outValue.TMS = tmsValue & 1
+        "lsr.w   %[tmsValue],    %[tmsValue],       #1                                     \n\t"  // tmsValue = tmsValue >> 1 (one bit ahead)
+
+        "repeatForEachBit%=:                                                               \n\t"
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue (TCK low)
+        "and.w   %[inValue],     %[readMask],       %[inValue],    ror %[readShift]        \n\t"  // inValue = (inValue << (from TDO-bit to 31th-bit)) & ( 1 << 31)
+        "orr.w   %[retValue],    %[inValue],        %[retValue],   lsr #1                  \n\t"  // retValue = (retValue >> 1) | inValue
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"  // outValueTck = outValue | (1 << TCK)
+        "lsr.w   %[tdiValue],    %[tdiValue],       #1                                     \n\t"  // tdiValue = tdiValue >> 1
+        "bfi     %[outValue],    %[tdiValue],       %[tdiPin],     #1                      \n\t"  // outValue.TDI = tdiValue & 1
+        "bfi     %[outValue],    %[tmsValue],       %[tmsPin],     #1                      \n\t"  // outValue.TMS = tmsValue & 1 (already shifted)
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValueTck (TCK high)
+        "subs.w  %[bits],        #1                                                        \n\t"  // bits--
+        JTAG_DELAY_HIGH_PART
+        "lsr.w   %[tmsValue],    %[tmsValue],       #1                                     \n\t"  // tmsValue = tmsValue >> 1 (doesn't touch the flags)
+        "ldr.w   %[inValue],     [%[gpioOutAddr], #-4]                                     \n\t"  // inValue = GPIO (IDR)
+        "bne     repeatForEachBit%=                                                        \n\t"  // if (bits != 0) then repeatForEachBit
+
+        // Word finished, process the last inValue and store the captured word
+        "and.w   %[inValue],     %[readMask],       %[inValue],    ror %[readShift]        \n\t"  // inValue = (inValue << (from TDO-bit to 31th-bit)) & ( 1 << 31)
+        "orr.w   %[retValue],    %[inValue],        %[retValue],   lsr #1                  \n\t"  // retValue = (retValue >> 1) | inValue
+        "str.w   %[retValue],    [%[readPtr]],      #4                                     \n\t"  // *readPtr++ = retValue
+        "cmp.w   %[count],       #0                                                        \n\t"
+        "bne     repeatForEachWord%=                                                       \n\t"  // if (count != 0) then repeatForEachWord
+
+        "cpsie if                                                                          \n\t"  // Enable IRQ, the critical section finished
+
+        // Outputs
+        : [retValue]        "+r"(retValue),
+          [count]           "+r"(count),
+          [bits]            "+r"(bits),
+          [outValue]        "+r"(outValue),
+          [outValueTck]     "+r"(outValueTck),
+          [inValue]         "+r"(inValue),
+          [tmsValue]        "+r"(tmsValue),
+          [tdiValue]        "+r"(tdiValue),
+          [tmsPtr]          "+r"(tmsBuffer),
+          [tdiPtr]          "+r"(tdiBuffer),
+          [readPtr]         "+r"(readBuffer)
+
+        // Inputs
+        : [gpioOutAddr]     "r"(addressWrite),
+          [readMask]        "r"(readMask),
+          [readShift]       "M"(PIN_E_TDO + 1),
+          [tmsPin]          "I"(PIN_E_TMS),
+          [tdiPin]          "I"(PIN_E_TDI),
+          [clock_mask]      "I"(powerOfTwo<PIN_E_TCK>()),
+          [resetValue]      "I"(nTRSTvalue << PIN_E_nTRST),
+          [delayHigh]       "n"(DELAY_HIGH),
+          [delayLow]        "n"(DELAY_LOW)
+
+        // Clobbers
+        : "memory", "cc"
+      );
+    }
+
+
+    template<uint8_t nTRSTvalue, uint32_t DELAY_HIGH, uint32_t DELAY_LOW>
+    __attribute__((optimize("-Ofast")))
+    void clockAsmIdle(uint32_t count) {
+      // TMS and TDI are held low and only the TCK is toggled, the NOPs are padding the loop to match
+      // the shiftAsmUltraSpeed TCK period. The long idle waits are split into chunks by the clockIdle
+      uint32_t addressWrite = GPIOE_BASE + 0x14; // ODR register of GPIO port E
+      uint32_t outValue     = nTRSTvalue << PIN_E_nTRST;
+      uint32_t outValueTck  = outValue | powerOfTwo<PIN_E_TCK>();
+
+      asm volatile (
+        "cpsid if                                                                          \n\t"  // Disable IRQ temporary for critical moment
+
+        "repeatForEachBit%=:                                                               \n\t"
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue (TCK low)
+        "nop                                                                               \n\t"  // six NOPs for the six instructions of the shiftAsmUltraSpeed low part
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValueTck (TCK high)
+        "subs.w  %[count],       #1                                                        \n\t"  // count--
+        JTAG_DELAY_HIGH_PART
+        "nop                                                                               \n\t"  // three NOPs for the NOP + LDR (2 cycles)
+        "nop                                                                               \n\t"
+        "nop                                                                               \n\t"
+        "bne     repeatForEachBit%=                                                        \n\t"  // if (count != 0) then repeatForEachBit
+
+        "cpsie if                                                                          \n\t"  // Enable IRQ, the critical section finished
+
+        // Outputs
+        : [count]           "+r"(count)
+
+        // Inputs
+        : [gpioOutAddr]     "r"(addressWrite),
+          [outValue]        "r"(outValue),
+          [outValueTck]     "r"(outValueTck),
+          [delayHigh]       "n"(DELAY_HIGH),
+          [delayLow]        "n"(DELAY_LOW)
+
+        // Clobbers
+        : "memory", "cc"
+      );
+    }
+
+
+#ifdef JTAG_GANG
+    template<uint8_t nTRSTvalue, uint32_t DELAY_HIGH, uint32_t DELAY_LOW>
+    __attribute__((optimize("-Ofast")))
+    void shiftAsmGang(const uint32_t length, const uint8_t *tdiSlices, uint8_t *tdoSlices) {
+      // Bit-sliced shifting of JTAG_GANG_CHAINS chains at once, each TCK takes one slice byte (bit N for the
+      // chain N) and inserts it into the TDI bank with a single BFI, so all the chains are written by
+      // the same ODR store and their TDOs are captured by the same IDR load (UBFX extracts the TDO bank
+      // back into one slice byte). The TMS is held low, the state moves are done with the regular kernels.
+      // The next slice is loaded one TCK ahead (in the low part), the load is conditional on the tdiEnd so the
+      // last TCK doesn't read past the slices. The 16-bit CMP lets the IT fold into it, the low part is then
+      // ORR + CMP + LDRB (2 cycles) + BFI + SUBS, the same 6 cycles as the shiftAsmUltraSpeed low part has. The
+      // SUBS is moved from the high part, where the UBFX + STRB take the place of the NOP + SUBS
+      uint32_t addressWrite = GPIOE_BASE + 0x14; // ODR register of GPIO port E (IDR is at the -4 offset from it)
+      const uint8_t *tdiEnd = tdiSlices + length;
+
+      uint32_t count        = length;
+      uint32_t outValue     = 0;
+      uint32_t outValueTck  = 0;
+      uint32_t inValue      = 0;
+      uint32_t tdiValue     = 0;
+
+      asm volatile (
+        "mov.w   %[outValue],    %[resetValue]                                             \n\t"  // outValue = (nRSTvalue << nRST), TMS and TDIs low
+        "ldrb.w  %[tdiValue],    [%[tdiPtr]],       #1                                     \n\t"  // tdiValue = *tdiPtr++
+        "bfi     %[outValue],    %[tdiValue],       %[tdiPin],     %[chains]               \n\t"  // outValue.TDIs = tdiValue & ((1 << chains) - 1)
+
+        "cpsid if                                                                          \n\t"  // Disable IRQ temporary for critical moment
+
+        "repeatForEachBit%=:                                                               \n\t"
+        "str.w   %[outValue],    [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValue (TCK low)
+        "orr.w   %[outValueTck], %[outValue],       %[clock_mask]                          \n\t"  // outValueTck = outValue | (1 << TCK)
+        "cmp     %[tdiPtr],      %[tdiEnd]                                                 \n\t"  // is there any next slice? (16-bit so the IT is folded)
+        "it      lo                                                                        \n\t"
+        "ldrblo.w %[tdiValue],   [%[tdiPtr]],       #1                                     \n\t"  // if (tdiPtr < tdiEnd) tdiValue = *tdiPtr++ (the next slice)
+        "bfi     %[outValue],    %[tdiValue],       %[tdiPin],     %[chains]               \n\t"  // outValue.TDIs = tdiValue (for the next TCK)
+        "subs.w  %[count],       #1                                                        \n\t"  // count--
+        JTAG_DELAY_LOW_PART
+        "str.w   %[outValueTck], [%[gpioOutAddr]]                                          \n\t"  // GPIO = outValueTck (TCK high)
+        JTAG_DELAY_HIGH_PART
+        "ldr.w   %[inValue],     [%[gpioOutAddr], #-4]                                     \n\t"  // inValue = GPIO (IDR)
+        "ubfx    %[inValue],     %[inValue],        %[tdoPin],     %[chains]               \n\t"  // inValue = (inValue >> TDO bank) & ((1 << chains) - 1)
+        "strb.w  %[inValue],     [%[readPtr]],      #1                                     \n\t"  // *readPtr++ = inValue
+        "bne     repeatForEachBit%=                                                        \n\t"  // if (count != 0) then repeatForEachBit
+
+        "cpsie if                                                                          \n\t"  // Enable IRQ, the critical section finished
+
+        // Outputs
+        : [count]           "+r"(count),
+          [outValue]        "+r"(outValue),
+          [outValueTck]     "+r"(outValueTck),
+          [inValue]         "+r"(inValue),
+          [tdiValue]        "+r"(tdiValue),
+          [tdiPtr]          "+r"(tdiSlices),
+          [readPtr]         "+r"(tdoSlices)
+
+        // Inputs
+        : [gpioOutAddr]     "r"(addressWrite),
+          [tdiEnd]          "r"(tdiEnd),
+          [chains]          "I"(JTAG_GANG_CHAINS),
+          [tdiPin]          "I"(JTAG_GANG_TDI_PIN),
+          [tdoPin]          "I"(JTAG_GANG_TDO_PIN),
+          [clock_mask]      "I"(powerOfTwo<PIN_E_TCK>()),
+          [resetValue]      "I"(nTRSTvalue << PIN_E_nTRST),
+          [delayHigh]       "n"(DELAY_HIGH),
+          [delayLow]        "n"(DELAY_LOW)
+
+        // Clobbers
+        : "memory", "cc"
+      );
+    }
+#endif
+
+
+    // All kernels with the same TCK timing, the whole set is swapped when the TCK speed changes
+    // so the kernels themselves do not have any runtime overhead of the speed setting
+    struct kernelsS {
+      uint32_t (*shiftTms)(const uint32_t length, uint32_t writeValue);
+      uint32_t (*shiftTmsInReset)(const uint32_t length, uint32_t writeValue);
+      uint32_t (*shiftTdi)(const uint32_t length, uint32_t writeValue);
+      uint32_t (*shiftTdiFused)(uint32_t entryCount, uint32_t entryValue, const uint32_t length, uint32_t writeValue, uint32_t exitCount, uint32_t exitValue);
+      uint64_t (*shiftTdi64)(const uint32_t length, const uint64_t writeValue);
+      void     (*shiftTdiBuffer)(const uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer, const uint32_t readStride);
+      void     (*shiftTdiFill)(const uint32_t length, const uint32_t *fillWord, uint32_t *readBuffer, const uint32_t readStride);
+      void     (*shiftVector)(const uint32_t length, const uint32_t *tmsBuffer, const uint32_t *tdiBuffer, uint32_t *readBuffer);
+      void     (*clockIdle)(uint32_t count);
+#ifdef JTAG_GANG
+      void     (*shiftGang)(const uint32_t length, const uint8_t *tdiSlices, uint8_t *tdoSlices);
+#endif
+      uint16_t cyclesHigh; // How many CPU cycles the TCK is high
+      uint16_t cyclesLow;  // How many CPU cycles the TCK is low
+    };
+
+
+    // Without any extra delay the shiftAsmUltraSpeed takes 18 cycles for one TCK (9.333MHz at 168MHz), split evenly
+    // between high and low part. The bit loops of all the other kernels are padded to the same instruction timing in
+    // both parts, so the tckGet figure holds for each of them. Only the TCKs between the loops (entry/data/exit of the
+    // fused, words of the buffer and vector, chunks of the idle) have the few extra setup instructions in them
+    const uint16_t KERNEL_CYCLES_HIGH = 9;
+    const uint16_t KERNEL_CYCLES_LOW  = 9;
+
+
+    template<uint32_t DELAY_HIGH, uint32_t DELAY_LOW>
+    constexpr kernelsS kernelsWithDelay() {
+      return {
+        &shiftAsmUltraSpeed<PIN_E_TMS, 1, DELAY_HIGH, DELAY_LOW>,
+        &shiftAsmUltraSpeed<PIN_E_TMS, 0, DELAY_HIGH, DELAY_LOW>,
+        &shiftAsmUltraSpeed<PIN_E_TDI, 1, DELAY_HIGH, DELAY_LOW>,
+        &shiftAsmFused<1, DELAY_HIGH, DELAY_LOW>,
+        &shiftAsm64<PIN_E_TDI, 1, DELAY_HIGH, DELAY_LOW>,
+        &shiftAsmBuffer<PIN_E_TDI, 1, DELAY_HIGH, DELAY_LOW, 4>,
+        &shiftAsmBuffer<PIN_E_TDI, 1, DELAY_HIGH, DELAY_LOW, 0>,
+        &shiftAsmVector<1, DELAY_HIGH, DELAY_LOW>,
+        &clockAsmIdle<1, DELAY_HIGH, DELAY_LOW>,
+#ifdef JTAG_GANG
+        &shiftAsmGang<1, DELAY_HIGH, DELAY_LOW>,
+#endif
+        KERNEL_CYCLES_HIGH + DELAY_HIGH,
+        KERNEL_CYCLES_LOW  + DELAY_LOW
+      };
+    }
+
+
+    // Ordered from the fastest to the slowest, the frequencies are for the 168MHz core clock
+    const std::array<kernelsS, 11> speeds = {
+        kernelsWithDelay<0,  0 >(), // 9.333MHz 50.0%
+        kernelsWithDelay<1,  2 >(), // 8.000MHz 47.6%
+        kernelsWithDelay<3,  3 >(), // 7.000MHz 50.0%
+        kernelsWithDelay<5,  5 >(), // 6.000MHz 50.0%
+        kernelsWithDelay<8,  8 >(), // 4.941MHz 50.0%
+        kernelsWithDelay<12, 12>(), // 4.000MHz 50.0%
+        kernelsWithDelay<19, 19>(), // 3.000MHz 50.0%
+        kernelsWithDelay<26, 26>(), // 2.400MHz 50.0%
+        kernelsWithDelay<33, 33>(), // 2.000MHz 50.0%
+        kernelsWithDelay<47, 47>(), // 1.500MHz 50.0%
+        kernelsWithDelay<75, 75>(), // 1.000MHz 50.0%
+    };
+
+
+    const kernelsS *kernels = &speeds[0];
+
+
+    tckSpeedS tckGet() {
+      const uint32_t period = kernels->cyclesHigh + kernels->cyclesLow;
+
+      return {
+        SystemCoreClock / period,
+        (kernels->cyclesHigh * 1000u) / period
+      };
+    }
+
+
+    tckSpeedS tckSet(uint32_t frequency) {
+      // Pick the fastest speed which is not above the requested frequency (or the slowest if all are above)
+      kernels = &speeds.back();
+      for (auto &speed: speeds) {
+        if (SystemCoreClock / (speed.cyclesHigh + speed.cyclesLow) <= frequency) {
+          kernels = &speed;
+          break;
+        }
+      }
+
+      return tckGet();
+    }
+
+
     void shiftTms(tap::tmsMove move) {
       JTAG_SHIFT_TIMMING_START();
-      shiftAsmUltraSpeed<PIN_E_TMS, 1>(move.amountOfBitsToShift, move.valueToShift);
+      kernels->shiftTms(move.amountOfBitsToShift, move.valueToShift);
       JTAG_SHIFT_TIMMING_END();
     }
 
 
     void shiftTmsRaw(uint32_t length, uint32_t writeValue) {
       JTAG_SHIFT_TIMMING_START();
-      shiftAsmUltraSpeed<PIN_E_TMS, 1>(length, writeValue);
+      kernels->shiftTms(length, writeValue);
       JTAG_SHIFT_TIMMING_END();
     }
 
 
     uint32_t shiftTdi(uint32_t length, uint32_t writeValue) {
       JTAG_SHIFT_TIMMING_START();
-      return shiftAsmUltraSpeed<PIN_E_TDI, 1>(length, writeValue);
+      return kernels->shiftTdi(length, writeValue);
+      JTAG_SHIFT_TIMMING_END();
+    }
+
+
+    uint32_t shiftTdiFused(tap::tmsMove entry, uint32_t length, uint32_t writeValue, tap::tmsMove exit) {
+      // The length has to be 1 <= length <= 32, the exit has to be at least 1 bit (as it's in the tapMoves table)
+      JTAG_SHIFT_TIMMING_START();
+      uint32_t ret = kernels->shiftTdiFused(entry.amountOfBitsToShift, entry.valueToShift, length, writeValue, exit.amountOfBitsToShift - 1, exit.valueToShift);
       JTAG_SHIFT_TIMMING_END();
+      return ret;
     }
 
 
+    uint64_t shiftTdi64(uint32_t length, uint64_t writeValue, tap::tmsMove exit) {
+      // The length has to be 1 <= length <= 64. With the exit (at least 1 bit) the last bit is shifted by the
+      // fused kernel together with the exit path, the 64-bit kernel keeps the TMS low for all its bits
+      const uint32_t bulk = (exit.amountOfBitsToShift) ? length - 1 : length;
+
+      JTAG_SHIFT_TIMMING_START();
+      uint64_t ret = kernels->shiftTdi64(bulk, writeValue);
+      if (bulk != length) {
+        const uint32_t last = kernels->shiftTdiFused(0, 0, 1, static_cast<uint32_t>(writeValue >> bulk) & 1, exit.amountOfBitsToShift - 1, exit.valueToShift);
+        ret |= static_cast<uint64_t>(last) << bulk;
+      }
+      JTAG_SHIFT_TIMMING_END();
+      return ret;
+    }
+
+
+    // How many bits one IRQ-disabled kernel invocation can take
+    uint32_t chunkBits(uint32_t length) {
+      return (irqChunkWords != 0 && irqChunkWords < (length + 31) / 32) ? irqChunkWords * 32 : length;
+    }
+
+
+#ifdef JTAG_IRQ_LATENCY
+    void irqWindowEnd(uint32_t start) {
+      const uint32_t cycles = DWT->CYCCNT - start;
+      if (cycles > irqWindowMax) irqWindowMax = cycles;
+    }
+#endif
+
+
+    // The last bit of a long scan shifted together with the exit path (exit.amountOfBitsToShift has to be at least 1),
+    // the captured bit is placed at the bit offset of the readBuffer (nullptr for the write-only scans)
+    void shiftLastBit(uint32_t offset, uint32_t writeBit, uint32_t *readBuffer, tap::tmsMove exit) {
+      JTAG_SHIFT_TIMMING_START();
+      const uint32_t read = kernels->shiftTdiFused(0, 0, 1, writeBit, exit.amountOfBitsToShift - 1, exit.valueToShift);
+      JTAG_SHIFT_TIMMING_END();
+
+      if (readBuffer == nullptr) return;
+
+      if (offset % 32) {
+        readBuffer[offset / 32] |= read << (offset % 32);
+      } else {
+        readBuffer[offset / 32] = read;
+      }
+    }
+
+
+    // The exit {0, 0} keeps the TAP in the shift state, otherwise the last bit is shifted together with
+    // the first TMS bit of the exit path (the buffer kernels keep the TMS low for all their bits)
+    void shiftWithBufferKernel(
+        void (*kernel)(const uint32_t, const uint32_t *, uint32_t *, const uint32_t),
+        uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer, tap::tmsMove exit, bool isFill = false) {
+
+      if (length == 0) return;
+
+      const uint32_t bulk = (exit.amountOfBitsToShift) ? length - 1 : length;
+
+      // Taken before the bulk, the captured words can be stored over the written ones (in-place shift)
+      uint32_t lastBit = 0;
+      if (bulk != length) {
+        const uint32_t lastWord = (isFill) ? writeBuffer[0] : writeBuffer[bulk / 32];
+        lastBit = (lastWord >> (bulk % 32)) & 1;
+      }
+
+      uint32_t discard;
+      uint32_t readStride = 4;
+      uint32_t *kernelRead = readBuffer;
+      if (readBuffer == nullptr) {
+        // Write-only scan, keep overwriting single dummy word instead of the response buffer
+        kernelRead = &discard;
+        readStride = 0;
+      }
+
+      // The kernel is invoked for each chunk (whole words), the IRQs get serviced between the invocations
+      const uint32_t chunk = chunkBits(bulk);
+
+      JTAG_SHIFT_TIMMING_START();
+      for (uint32_t offset = 0; offset < bulk; offset += chunk) {
+        const uint32_t word = offset / 32;
+
+#ifdef JTAG_IRQ_LATENCY
+        const uint32_t start = DWT->CYCCNT;
+#endif
+        kernel(std::min(bulk - offset, chunk), (isFill) ? writeBuffer : writeBuffer + word,
+               (readStride) ? kernelRead + word : kernelRead, readStride);
+#ifdef JTAG_IRQ_LATENCY
+        irqWindowEnd(start);
+#endif
+      }
+      JTAG_SHIFT_TIMMING_END();
+
+      // The last word might be partial, shift it from the MSB side to be aligned to the LSB
+      const uint32_t lastBits = bulk % 32;
+      if (readStride && lastBits) {
+        readBuffer[(bulk - 1) / 32] >>= (32 - lastBits);
+      }
+
+      if (bulk != length) shiftLastBit(bulk, lastBit, readBuffer, exit);
+    }
+
+
+    void shiftTdiBuffer(uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer, tap::tmsMove exit) {
+      shiftWithBufferKernel(kernels->shiftTdiBuffer, length, writeBuffer, readBuffer, exit);
+    }
+
+
+    void shiftTdiFill(uint32_t length, bool fillBit, uint32_t *readBuffer, tap::tmsMove exit) {
+      // The kernel keeps re-loading this single word, so the TDI stays constant without any data buffer
+      const uint32_t fillWord = (fillBit) ? 0xffff'ffff : 0;
+      shiftWithBufferKernel(kernels->shiftTdiFill, length, &fillWord, readBuffer, exit, true);
+    }
+
+
+    void shiftVector(uint32_t length, const uint32_t *tmsBuffer, const uint32_t *tdiBuffer, uint32_t *readBuffer) {
+      if (length == 0) return;
+
+      const uint32_t chunk = chunkBits(length);
+
+      JTAG_SHIFT_TIMMING_START();
+      for (uint32_t offset = 0; offset < length; offset += chunk) {
+        const uint32_t word = offset / 32;
+
+#ifdef JTAG_IRQ_LATENCY
+        const uint32_t start = DWT->CYCCNT;
+#endif
+        kernels->shiftVector(std::min(length - offset, chunk), tmsBuffer + word, tdiBuffer + word, readBuffer + word);
+#ifdef JTAG_IRQ_LATENCY
+        irqWindowEnd(start);
+#endif
+      }
+      JTAG_SHIFT_TIMMING_END();
+
+      // The last word might be partial, shift it from the MSB side to be aligned to the LSB
+      const uint32_t lastBits = length % 32;
+      if (lastBits) {
+        readBuffer[(length - 1) / 32] >>= (32 - lastBits);
+      }
+    }
+
+
+    void clockIdle(uint32_t count) {
+      if (count == 0) return;
+
+      const uint32_t chunk = chunkBits(count);
+
+      JTAG_SHIFT_TIMMING_START();
+      for (uint32_t offset = 0; offset < count; offset += chunk) {
+#ifdef JTAG_IRQ_LATENCY
+        const uint32_t start = DWT->CYCCNT;
+#endif
+        kernels->clockIdle(std::min(count - offset, chunk));
+#ifdef JTAG_IRQ_LATENCY
+        irqWindowEnd(start);
+#endif
+      }
+      JTAG_SHIFT_TIMMING_END();
+    }
+
+
+    uint32_t irqChunk(uint32_t words) {
+      irqChunkWords = words;
+
+#ifdef JTAG_IRQ_LATENCY
+      const uint32_t ret = irqWindowMax;
+      irqWindowMax = 0;
+      return ret;
+#else
+      return 0;
+#endif
+    }
+
+
+#ifdef JTAG_IRQ_CHUNK_BENCHMARK
+    void irqChunkBenchmark() {
+      // The TAP is reset and parked in the RunTestIdle, there the TDI doesn't matter and the TMS held
+      // low keeps it there, so the buffer kernel can be clocked without touching the target
+      const uint32_t length = 4096;
+      const std::array<uint32_t, 4> chunks = { 0, 16, 4, 1 };
+
+      static uint32_t data[length / 32];
+      uint32_t wholeCycles = 0;
+
+      tap::resetSM();
+      tap::stateMove(tap::stateE::RunTestIdle);
+
+      BSP_LCD_SetBackColor(LCD_COLOR_WHITE);
+      BSP_LCD_SetTextColor(LCD_COLOR_BLACK);
+
+      for (uint32_t i = 0; i < chunks.size(); i++) {
+        const uint32_t previous = irqChunkWords;
+        irqChunk(chunks[i]);
+
+        const uint32_t start  = DWT->CYCCNT;
+        shiftTdiBuffer(length, data, data, {0, 0});
+        const uint32_t cycles = DWT->CYCCNT - start;
+
+        const uint32_t window = irqChunk(previous);
+        if (chunks[i] == 0) wholeCycles = cycles;
+
+        // Worst IRQ-disabled window (an IRQ waits at most this long) and the throughput cost against the single window
+        // (both with 1 decimal place)
+        const uint32_t costPermille = (cycles > wholeCycles) ? (cycles - wholeCycles) * 1000 / wholeCycles : 0;
+        char buf[40];
+        sprintf(buf, "Chunk %2luw %5lu.%01luus +%lu.%01lu%%", chunks[i],
+                window / (SystemCoreClock / 1000000), (window % (SystemCoreClock / 1000000)) * 10 / (SystemCoreClock / 1000000),
+                costPermille / 10, costPermille % 10);
+        BSP_LCD_DisplayString(5, 250 + i * 10, buf);
+      }
+    }
+#endif
+
+
+#ifdef JTAG_SPI_PINOUT
+    void pinoutInit() {
+      // The CubeMX configuration is for the original pinout, the PE2-PE6 are configured again for the remapped
+      // signals. Same pulls and speeds as the original pins, only the TDO moved from the PE6 to the PE5
+      GPIO_InitTypeDef init = {0};
+
+      HAL_GPIO_WritePin(GPIOE, JTAG_TMS_Pin | JTAG_TCK_Pin | JTAG_TDI_Pin, GPIO_PIN_RESET);
+
+      init.Pin   = JTAG_TMS_Pin;
+      init.Mode  = GPIO_MODE_OUTPUT_PP;
+      init.Pull  = GPIO_PULLDOWN;
+      init.Speed = GPIO_SPEED_FREQ_MEDIUM;
+      HAL_GPIO_Init(GPIOE, &init);
+
+      // The TCK and TDI are switched to the SPI4 alternate function only for the duration of the SPI transfers
+      init.Pin   = JTAG_TCK_Pin | JTAG_TDI_Pin | JTAG_nTRST_Pin;
+      init.Pull  = GPIO_PULLUP;
+      HAL_GPIO_Init(GPIOE, &init);
+
+      init.Pin   = JTAG_TDO_Pin;
+      init.Mode  = GPIO_MODE_INPUT;
+      init.Pull  = GPIO_PULLUP;
+      HAL_GPIO_Init(GPIOE, &init);
+    }
+#endif
+
+
+#ifdef JTAG_GANG
+    void gangInit() {
+      // The gang banks are not part of the CubeMX pin configuration (they would collide with the FMC on
+      // the Discovery board), so they are configured here the same way as the PE4 TDI and PE6 TDO
+      GPIO_InitTypeDef init = {0};
+      const uint32_t bank   = (1 << JTAG_GANG_CHAINS) - 1;
+
+      init.Pin   = bank << JTAG_GANG_TDI_PIN;
+      init.Mode  = GPIO_MODE_OUTPUT_PP;
+      init.Pull  = GPIO_PULLUP;
+      init.Speed = GPIO_SPEED_FREQ_MEDIUM;
+      HAL_GPIO_Init(GPIOE, &init);
+
+      init.Pin   = bank << JTAG_GANG_TDO_PIN;
+      init.Mode  = GPIO_MODE_INPUT;
+      init.Pull  = GPIO_PULLUP;
+      HAL_GPIO_Init(GPIOE, &init);
+    }
+
+
+    void shiftGang(uint32_t length, const uint8_t *tdiSlices, uint8_t *tdoSlices) {
+      if (length == 0) return;
+
+      // One slice byte per TCK, so the chunk offset is the byte offset in both slice buffers
+      const uint32_t chunk = chunkBits(length);
+
+      JTAG_SHIFT_TIMMING_START();
+      for (uint32_t offset = 0; offset < length; offset += chunk) {
+#ifdef JTAG_IRQ_LATENCY
+        const uint32_t start = DWT->CYCCNT;
+#endif
+        kernels->shiftGang(std::min(length - offset, chunk), tdiSlices + offset, tdoSlices + offset);
+#ifdef JTAG_IRQ_LATENCY
+        irqWindowEnd(start);
+#endif
+      }
+      JTAG_SHIFT_TIMMING_END();
+    }
+#endif
+
+
     void resetSignal(uint8_t isSrst, int8_t length) {
       // TODO: implement srst and trst
       // should do signal reset instead of the state machine reset
@@ -165,7 +1120,11 @@ namespace jtag {
 
       if (length < 0) length = 32;
       // We will pull the reset low, while shifting 1s to TMS (which should put it into reset and keep it there on its own as well)
-      shiftAsmUltraSpeed<PIN_E_TMS, 0>(length, 0xffff'ffff);
+      kernels->shiftTmsInReset(length, 0xffff'ffff);
+
+#ifdef JTAG_IR_CACHE
+      tap::irCache::invalidate();
+#endif
     }
 
 
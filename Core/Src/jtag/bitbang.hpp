@@ -18,12 +18,51 @@ extern "C" {
 namespace jtag {
   namespace bitbang {
 
+    struct tckSpeedS {
+      uint32_t frequency;    // Achieved TCK frequency in Hz
+      uint32_t dutyPermille; // How long the TCK is high from the whole period (in 0.1% units)
+    };
+
+    tckSpeedS tckGet(void);
+
+    tckSpeedS tckSet(uint32_t frequency);
+
     void shiftTms(tap::tmsMove move);
 
     void shiftTmsRaw(uint32_t length, uint32_t write_value);
 
     uint32_t shiftTdi(uint32_t length, uint32_t write_value);
 
+    uint32_t shiftTdiFused(tap::tmsMove entry, uint32_t length, uint32_t writeValue, tap::tmsMove exit);
+
+    uint64_t shiftTdi64(uint32_t length, uint64_t writeValue, tap::tmsMove exit);
+
+    void shiftTdiBuffer(uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer, tap::tmsMove exit);
+
+    void shiftTdiFill(uint32_t length, bool fillBit, uint32_t *readBuffer, tap::tmsMove exit);
+
+    void shiftLastBit(uint32_t offset, uint32_t writeBit, uint32_t *readBuffer, tap::tmsMove exit);
+
+    void shiftVector(uint32_t length, const uint32_t *tmsBuffer, const uint32_t *tdiBuffer, uint32_t *readBuffer);
+
+    void clockIdle(uint32_t count);
+
+    uint32_t irqChunk(uint32_t words);
+
+#ifdef JTAG_IRQ_CHUNK_BENCHMARK
+    void irqChunkBenchmark(void);
+#endif
+
+#ifdef JTAG_SPI_PINOUT
+    void pinoutInit(void);
+#endif
+
+#ifdef JTAG_GANG
+    void gangInit(void);
+
+    void shiftGang(uint32_t length, const uint8_t *tdiSlices, uint8_t *tdoSlices);
+#endif
+
     void resetSignal(uint8_t isSrst, int8_t length);
 
   }
@@ -13,6 +13,9 @@
 typedef uint64_t requestAndResponse;
 typedef requestAndResponse (*commandHandler)(uint32_t *bufRequest, uint32_t *bufResponse);
 
+// Handler which dispatches the next command on its own (tail call), the remaining IDs are passed in the R2
+typedef requestAndResponse (*threadedCommandHandler)(uint32_t *bufRequest, uint32_t *bufResponse, uint32_t commandIds);
+
 // Black magic, abusing 64-bit type to transport efficiently pair of 32-bit values
 // be careful of using the same order, then the input R0+R1 can just be transmitted as return R0+R1
 // directly without using single instruction
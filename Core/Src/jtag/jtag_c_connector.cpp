@@ -26,12 +26,28 @@ void jtag_tap_telemetry_dispay() {
 #endif
 
 void jtag_setup() {
+#ifdef JTAG_SPI_PINOUT
+  jtag::bitbang::pinoutInit();
+#endif
+
+#ifdef JTAG_GANG
+  jtag::bitbang::gangInit();
+#endif
+
+  jtag::usb::init();
+
+#ifdef JTAG_USB_DISPATCH_BENCHMARK
+  jtag::usb::dispatchBenchmark();
+#endif
 
+#ifdef JTAG_IRQ_CHUNK_BENCHMARK
+  jtag::bitbang::irqChunkBenchmark();
+#endif
 }
 
 
-uint32_t requestBuf[JTAG_USB_REPORT_SIZE + 4] = { 0 };
-uint32_t responseBuf[JTAG_USB_REPORT_SIZE]    = { 0 };
+uint32_t requestBuf[JTAG_USB_REPORT_WORDS + 4] = { 0 };
+uint32_t responseBuf[JTAG_USB_REPORT_WORDS]    = { 0 };
 
 
 requestAndResponse jtag_usb_parseQueue(uint32_t *req, uint32_t *res) {
@@ -39,6 +55,31 @@ requestAndResponse jtag_usb_parseQueue(uint32_t *req, uint32_t *res) {
 }
 
 
+void jtag_usb_reportReceived(const uint8_t *report) {
+  jtag::usb::reportReceived(report);
+}
+
+
+void jtag_usb_bulkArm() {
+  jtag::usb::bulkArm();
+}
+
+
+void jtag_usb_bulkReceived(const uint8_t *buf, uint32_t length) {
+  jtag::usb::bulkReceived(buf, length);
+}
+
+
+void jtag_usb_bulkSent() {
+  jtag::usb::bulkSent();
+}
+
+
+void jtag_usb_poll() {
+  jtag::usb::poll();
+}
+
+
 void jtag_loop() {
   // Just experiments to test various features
 
@@ -26,6 +26,16 @@ void jtag_loop(void);
 
 requestAndResponse jtag_usb_parseQueue(uint32_t *req, uint32_t *res);
 
+void jtag_usb_reportReceived(const uint8_t *report);
+
+void jtag_usb_bulkArm(void);
+
+void jtag_usb_bulkReceived(const uint8_t *buf, uint32_t length);
+
+void jtag_usb_bulkSent(void);
+
+void jtag_usb_poll(void);
+
 
 #ifdef __cplusplus
 }
@@ -14,10 +14,106 @@
 
 #define JTAG_FW_VERSION 1
 
-#define JTAG_USB_REPORT_SIZE 32
+#define JTAG_USB_REPORT_SIZE  64                            // In bytes, has to match the HID report descriptor
+#define JTAG_USB_REPORT_WORDS (JTAG_USB_REPORT_SIZE / 4)
+#define JTAG_USB_FRAME_PAYLOAD (JTAG_USB_REPORT_SIZE - 4)   // Each report starts with one word frame header
+#define JTAG_USB_STREAM_SIZE  4096                          // In bytes, the largest batch of HID frames joined into one request stream
+#define JTAG_USB_STREAM_WORDS (JTAG_USB_STREAM_SIZE / 4)
+#define JTAG_USB_REPORT_SLOTS 4                             // Entries of the request and the response rings (power of two), reports are received while others execute
+
+#define JTAG_USB_BULK_SIZE    4096                          // In bytes, the largest vendor bulk OUT transfer, has to be multiple of the max packet size
+#define JTAG_USB_BULK_WORDS   (JTAG_USB_BULK_SIZE / 4)
+
+#define JTAG_CHAIN_MAX_TAPS   8                             // TAPs which can be described with the chainSetup (the mismatch response is a 32-bit mask)
+
+// Uncomment to drive several independent chains (sharing the TCK/TMS/nTRST) with the gangScan. Each chain has
+// its own TDI and TDO pin on the port E, the TDI pins and the TDO pins each form a contiguous bank. On the
+// STM32F429I-Discovery the PE0-PE1 and PE7-PE15 are the FMC lines of the SDRAM (LCD frame buffer), so the
+// banks below need a board where these pins are free
+//#define JTAG_GANG
+#ifdef JTAG_GANG
+#define JTAG_GANG_CHAINS      4                             // Up to 8, each TCK of the gangScan takes one byte (bit N = chain N)
+#define JTAG_GANG_TDI_PIN     7                             // TDI of the chain 0, the next chains follow on the next pins
+#define JTAG_GANG_TDO_PIN     11                            // TDO of the chain 0, the next chains follow on the next pins
+
+#if JTAG_GANG_CHAINS < 1 || JTAG_GANG_CHAINS > 8
+#error "The gang slices are single bytes, 1 to 8 chains are supported"
+#endif
+
+#if (JTAG_GANG_TDI_PIN < 7 && JTAG_GANG_TDI_PIN + JTAG_GANG_CHAINS > 2) || (JTAG_GANG_TDO_PIN < 7 && JTAG_GANG_TDO_PIN + JTAG_GANG_CHAINS > 2)
+#error "The gang banks can't overlap the PE2-PE6 JTAG pins"
+#endif
+
+#if JTAG_GANG_TDI_PIN < JTAG_GANG_TDO_PIN + JTAG_GANG_CHAINS && JTAG_GANG_TDO_PIN < JTAG_GANG_TDI_PIN + JTAG_GANG_CHAINS
+#error "The gang TDI and TDO banks can't overlap"
+#endif
+
+#if JTAG_GANG_TDI_PIN + JTAG_GANG_CHAINS > 16 || JTAG_GANG_TDO_PIN + JTAG_GANG_CHAINS > 16
+#error "The gang banks have to fit into the port E"
+#endif
+#endif
+
+//#define JTAG_WAVEFORM       // Uncomment to allow the long scans to be shifted by the TIM1 + DMA2 waveform backend (IRQs stay enabled), selected with the waveform command
+#define JTAG_WAVEFORM_CHUNK   512                           // TCKs packed per DMA chunk (multiple of 32), each TCK takes 12 bytes of the double buffered RAM
+
+// Uncomment for a daughter board wired with the TCK/TDO/TDI on the SPI4 pins (PE2 TCK, PE3 TMS, PE4 nTRST, PE5 TDO,
+// PE6 TDI), the original pinout has the TCK on the PE3 which has no SPI function and the TDO on the SPI4 MOSI
+//#define JTAG_SPI_PINOUT
+#ifdef JTAG_SPI_PINOUT
+#undef  JTAG_TCK_Pin
+#undef  JTAG_TMS_Pin
+#undef  JTAG_nTRST_Pin
+#undef  JTAG_TDO_Pin
+#undef  JTAG_TDI_Pin
+#define JTAG_TCK_Pin          GPIO_PIN_2
+#define JTAG_TMS_Pin          GPIO_PIN_3
+#define JTAG_nTRST_Pin        GPIO_PIN_4
+#define JTAG_TDO_Pin          GPIO_PIN_5
+#define JTAG_TDI_Pin          GPIO_PIN_6
+#endif
+
+//#define JTAG_SPI            // Uncomment to allow the byte-aligned middle of the long scans to be shifted by the SPI4 + DMA2, selected with the spi command
+#if defined(JTAG_SPI) && !defined(JTAG_SPI_PINOUT)
+#error "The SPI backend needs the JTAG_SPI_PINOUT, in the original pinout the TCK/TDO/TDI are not on the SPI pins"
+#endif
+
+//#define JTAG_USB_STATS      // Uncomment to show the USB commands per second and per-report latency on the LCD
 
 #define JTAG_TAP_TELEMETRY // Comment-out to disable the TAP state machine telemetry
 
+//#define JTAG_IR_CACHE      // Uncomment to skip write-only IR scans which would shift the same instruction as is already in the IR
+
+//#define JTAG_TAP_LAZY_MOVES // Uncomment to defer the scan's RunTestIdle end state until something needs it (the next scan can go there directly without the idle visit)
+
+//#define JTAG_USB_THREADED_DISPATCH  // Uncomment to let each command handler tail-call the next one instead of returning to the parseQueue loop (ignored in the unoptimised builds before GCC 15)
+//#define JTAG_USB_DISPATCH_BENCHMARK // Uncomment to measure (with DWT cycle counter) the threaded dispatch against the loop on startup and show it on the LCD
+
+#if defined(JTAG_USB_DISPATCH_BENCHMARK) && !defined(JTAG_USB_THREADED_DISPATCH)
+#error "The dispatch benchmark needs the threaded dispatch to be enabled as well"
+#endif
+
+// The checks are nested, the preprocessors without the __has_cpp_attribute can't parse it inside the defined() condition
+#ifdef __has_cpp_attribute
+#if __has_cpp_attribute(gnu::musttail)
+#define JTAG_HAS_MUSTTAIL
+#endif
+#endif
+
+// Without the musttail only the sibling call optimisation (-O2/-Os) turns the handler calls into tail jumps,
+// the unoptimised (Debug) builds fall back to the parseQueue loop instead of nesting a stack frame per command
+#if defined(JTAG_USB_THREADED_DISPATCH) && !defined(JTAG_HAS_MUSTTAIL) && !defined(__OPTIMIZE__)
+#undef JTAG_USB_THREADED_DISPATCH
+#undef JTAG_USB_DISPATCH_BENCHMARK
+#endif
+
+#define JTAG_IRQ_CHUNK_WORDS  4                             // Words (32 TCKs each) the buffer/vector/idle/gang kernels shift in one IRQ-disabled window, 0 = whole shift, can be changed with the irqChunk command
+//#define JTAG_IRQ_LATENCY          // Uncomment to measure (with DWT cycle counter) the longest IRQ-disabled window of the buffer/vector/idle/gang kernels, reported by the irqChunk command
+//#define JTAG_IRQ_CHUNK_BENCHMARK  // Uncomment to measure the IRQ-disabled window and the throughput cost of a few chunk sizes on startup and show it on the LCD (in place of the USB stats rows)
+
+#if defined(JTAG_IRQ_CHUNK_BENCHMARK) && !defined(JTAG_IRQ_LATENCY)
+#error "The chunk benchmark needs the IRQ latency measurement to be enabled as well"
+#endif
+
 //#define JTAG_SHIFT_TIMMING // Comment-out to disable the bitbang shifting time LED output (can be used on the scope to count time spent bit-banging)
 #ifdef JTAG_SHIFT_TIMMING
 #define JTAG_SHIFT_TIMMING_PORT LD3_GPIO_Port
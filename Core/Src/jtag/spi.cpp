@@ -0,0 +1,174 @@
+/*
+ * SPI4 + DMA backend for the byte-aligned part of the long scans
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: agent@local
+ *     License: GPLv2
+ */
+
+#include <cstdint>
+#include <algorithm>
+
+#include "spi.hpp"
+#include "bitbang.hpp"
+
+#include "main.h"
+#include "jtag_global.h"
+
+
+#ifdef JTAG_SPI
+
+namespace jtag {
+
+  namespace spi {
+
+    // SPI mode 0 with LSB first matches the JTAG: TDI is changed while the TCK is low and sampled by the TAP on
+    // the rising edge, the TDO is changed by the TAP on the falling edge and sampled by the SPI on the rising edge.
+    // The scan is already in the Shift-xR (the entry TMS bits are clocked by the bit-bang kernels), the whole
+    // bytes are transferred by the SPI4 (DMA2 Stream3/Stream4 channel 5), the TCK/TDI/TDO pins are switched to
+    // the alternate function just for the transfer. The last partial byte is left to the bit-bang kernel and
+    // the exit TMS bits as well. The request/response words are little-endian, so the DMA can transfer their
+    // bytes directly in both directions
+
+    const uint32_t DMA_CHANNEL  = 5;
+    const uint32_t MAX_TRANSFER = 65535; // NDTR limit
+    const uint32_t AF_SPI4      = 5;
+
+
+    constexpr uint32_t modeBits(uint32_t pins, uint32_t mode) {
+      uint32_t ret = 0;
+      for (uint32_t pin = 0; pin < 16; pin++) {
+        if (pins & (1u << pin)) ret |= mode << (2 * pin);
+      }
+      return ret;
+    }
+
+
+    constexpr uint32_t afBits(uint32_t pins, uint32_t alternate) {
+      uint32_t ret = 0;
+      for (uint32_t pin = 0; pin < 8; pin++) {
+        if (pins & (1u << pin)) ret |= alternate << (4 * pin);
+      }
+      return ret;
+    }
+
+
+    const uint32_t SPI_PINS      = JTAG_TCK_Pin | JTAG_TDI_Pin | JTAG_TDO_Pin;
+    const uint32_t MODER_MASK    = modeBits(SPI_PINS, 0b11);
+    const uint32_t MODER_SPI     = modeBits(SPI_PINS, 0b10);                           // All alternate function
+    const uint32_t MODER_BITBANG = modeBits(JTAG_TCK_Pin | JTAG_TDI_Pin, 0b01);        // TCK, TDI outputs, TDO input
+
+    static_assert(((JTAG_TCK_Pin | JTAG_TDI_Pin | JTAG_TDO_Pin) & 0xff00) == 0, "The SPI4 pins are expected in the AFR[0] (PE2, PE5, PE6)");
+
+
+    uint32_t threshold = 0;  // 0 = backend not selected for any scan
+    uint8_t  discard   = 0;  // RX target of the write-only scans
+
+
+    // The pins are switched into the SPI only for the transfer, the TCK is driven low by the GPIO
+    // first, so neither of the switches makes a rising edge (the falling edge only lets the TAP present the TDO)
+    void toSpi() {
+      GPIOE->BSRR  = JTAG_TCK_Pin << 16;
+      GPIOE->MODER = (GPIOE->MODER & ~MODER_MASK) | MODER_SPI;
+    }
+
+
+    void toBitbang() {
+      GPIOE->BSRR  = JTAG_TCK_Pin << 16;
+      GPIOE->MODER = (GPIOE->MODER & ~MODER_MASK) | MODER_BITBANG;
+    }
+
+
+    void transfer(uint32_t bytes, const uint8_t *writeBytes, uint8_t *readBytes) {
+      // Drain anything left in the SPI from before, so the RX DMA starts with the first byte of this transfer
+      (void)SPI4->DR;
+      (void)SPI4->SR;
+
+      DMA2->LIFCR = DMA_LIFCR_CTCIF3 | DMA_LIFCR_CHTIF3 | DMA_LIFCR_CTEIF3 | DMA_LIFCR_CDMEIF3 | DMA_LIFCR_CFEIF3;
+      DMA2->HIFCR = DMA_HIFCR_CTCIF4 | DMA_HIFCR_CHTIF4 | DMA_HIFCR_CTEIF4 | DMA_HIFCR_CDMEIF4 | DMA_HIFCR_CFEIF4;
+
+      // SPI4 DR to memory, the write-only scans keep overwriting a single dummy byte
+      DMA2_Stream3->PAR  = reinterpret_cast<uint32_t>(&SPI4->DR);
+      DMA2_Stream3->M0AR = reinterpret_cast<uint32_t>((readBytes != nullptr) ? readBytes : &discard);
+      DMA2_Stream3->NDTR = bytes;
+      DMA2_Stream3->CR   = (DMA_CHANNEL << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL | ((readBytes != nullptr) ? DMA_SxCR_MINC : 0);
+
+      // Memory to SPI4 DR
+      DMA2_Stream4->PAR  = reinterpret_cast<uint32_t>(&SPI4->DR);
+      DMA2_Stream4->M0AR = reinterpret_cast<uint32_t>(writeBytes);
+      DMA2_Stream4->NDTR = bytes;
+      DMA2_Stream4->CR   = (DMA_CHANNEL << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL_1 | DMA_SxCR_MINC | DMA_SxCR_DIR_0;
+
+      // RX first, so no received byte is missed
+      DMA2_Stream3->CR  |= DMA_SxCR_EN;
+      DMA2_Stream4->CR  |= DMA_SxCR_EN;
+
+      // The last byte is received after its last TCK, the IRQs (USB) are serviced while waiting
+      while (!(DMA2->LISR & DMA_LISR_TCIF3));
+      while (SPI4->SR & SPI_SR_BSY);
+
+      DMA2_Stream3->CR = 0;
+      DMA2_Stream4->CR = 0;
+    }
+
+
+    // Returns the achieved TCK in Hz (0 = the backend stays disabled)
+    uint32_t setup(uint32_t newThreshold, uint32_t frequency) {
+      threshold = 0;
+      SPI4->CR1 = 0;
+
+      if (newThreshold == 0) return 0;
+
+      __HAL_RCC_SPI4_CLK_ENABLE();
+      __HAL_RCC_DMA2_CLK_ENABLE();
+
+      // The fastest prescaler (PCLK2 / 2^(BR+1)) which doesn't exceed the requested frequency, or the slowest one
+      const uint32_t pclk2    = HAL_RCC_GetPCLK2Freq();
+      uint32_t       baudRate = 0;
+      while (baudRate < 7 && (pclk2 >> (baudRate + 1)) > frequency) baudRate++;
+
+      GPIOE->AFR[0] = (GPIOE->AFR[0] & ~afBits(SPI_PINS, 0xf)) | afBits(SPI_PINS, AF_SPI4);
+
+      SPI4->CR2 = SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN;
+      SPI4->CR1 = SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI | SPI_CR1_LSBFIRST | (baudRate << SPI_CR1_BR_Pos) | SPI_CR1_SPE;
+
+      threshold = std::max<uint32_t>(newThreshold, 8);
+      return pclk2 >> (baudRate + 1);
+    }
+
+
+    bool isSelected(uint32_t length) {
+      return threshold != 0 && length >= threshold;
+    }
+
+
+    void shiftTdiBuffer(uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer) {
+      const uint32_t bytes    = length / 8;
+      const uint32_t tailBits = length % 8;
+
+      const uint8_t *writeBytes = reinterpret_cast<const uint8_t *>(writeBuffer);
+      uint8_t       *readBytes  = reinterpret_cast<uint8_t *>(readBuffer);
+
+      // The DMA writes only the whole bytes, the rest of the last response word has to be cleared
+      if (readBuffer != nullptr) readBuffer[(length - 1) / 32] = 0;
+
+      JTAG_SHIFT_TIMMING_START();
+      toSpi();
+      for (uint32_t offset = 0; offset < bytes; offset += MAX_TRANSFER) {
+        const uint32_t chunk = std::min(bytes - offset, MAX_TRANSFER);
+        transfer(chunk, writeBytes + offset, (readBytes != nullptr) ? readBytes + offset : nullptr);
+      }
+      toBitbang();
+      JTAG_SHIFT_TIMMING_END();
+
+      if (tailBits) {
+        // The last partial byte is shifted by the bit-bang kernel, the exit TMS bits are done by the caller
+        const uint32_t read = bitbang::shiftTdi(tailBits, writeBytes[bytes]);
+        if (readBytes != nullptr) readBytes[bytes] = read & ((1u << tailBits) - 1);
+      }
+    }
+
+  }
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * spi.hpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: agent@local
+ *     License: GPLv2
+ */
+
+#ifndef SRC_JTAG_SPI_HPP_
+#define SRC_JTAG_SPI_HPP_
+
+#include <cstdint>
+
+#include "jtag_global.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+namespace jtag {
+
+  namespace spi {
+
+#ifdef JTAG_SPI
+    uint32_t setup(uint32_t threshold, uint32_t frequency);
+
+    bool isSelected(uint32_t length);
+
+    void shiftTdiBuffer(uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer);
+#endif
+
+  }
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_JTAG_SPI_HPP_ */
@@ -0,0 +1,61 @@
+/*
+ * spsc_ring.hpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: agent@local
+ *     License: GPLv2
+ */
+
+#ifndef SRC_JTAG_SPSC_RING_HPP_
+#define SRC_JTAG_SPSC_RING_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+
+namespace jtag {
+
+  // Lock-free single-producer/single-consumer ring, the producer and the consumer can run in different
+  // contexts (USB IRQ and main loop). Entries are used in place: the producer fills back() and then
+  // push() publishes it, the consumer uses front() and pop() gives the entry back to the producer.
+  // The head is written only by the producer and the tail only by the consumer, so aligned 32-bit
+  // atomics are enough and no IRQs have to be disabled.
+  template<typename T, uint32_t SIZE>
+  struct spscRingS {
+    static_assert((SIZE & (SIZE - 1)) == 0, "The ring size has to be power of two");
+
+    std::array<T, SIZE>   entries = {};
+    std::atomic<uint32_t> head    = { 0 };  // free running, wraps around naturally
+    std::atomic<uint32_t> tail    = { 0 };
+
+    // Producer side
+    bool isFull() const {
+      return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) == SIZE;
+    }
+
+    T& back() {
+      return entries[head.load(std::memory_order_relaxed) % SIZE];
+    }
+
+    void push() {
+      head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side
+    bool isEmpty() const {
+      return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+    }
+
+    T& front() {
+      return entries[tail.load(std::memory_order_relaxed) % SIZE];
+    }
+
+    void pop() {
+      tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+  };
+
+}
+
+#endif /* SRC_JTAG_SPSC_RING_HPP_ */
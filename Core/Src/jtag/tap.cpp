@@ -7,6 +7,7 @@
  */
 
 #include <array>
+#include <cstdio>
 
 #ifdef __cplusplus
 extern "C" {
@@ -52,10 +53,62 @@ namespace jtag {
 		    /* UpdateIR    */ {  {3, 0b111},   {1, 0b0},   {1, 0b1},    {2, 0b01},   {3, 0b001},   {3, 0b101},   {4, 0b0101},   {5, 0b10101},   {4, 0b1101},   {2, 0b11},   {3, 0b011},   {4, 0b0011},   {4, 0b1011},   {5, 0b01011},   {6, 0b101011},   {5, 0b11011}    }
 		};
 
+		// Where a single TCK moves from each state, for TMS low and high
+		const stateE nextStates[stateESize][2] = {
+		    /* TLReset     */ { stateE::RunTestIdle, stateE::TestLogicReset },
+		    /* RunTestIdle */ { stateE::RunTestIdle, stateE::SelectDrScan   },
+		    /* SelectDR    */ { stateE::CaptureDr,   stateE::SelectIrScan   },
+		    /* CaptureDR   */ { stateE::ShiftDr,     stateE::Exit1Dr        },
+		    /* ShiftDR     */ { stateE::ShiftDr,     stateE::Exit1Dr        },
+		    /* Exit1DR     */ { stateE::PauseDr,     stateE::UpdateDr       },
+		    /* PauseDR     */ { stateE::PauseDr,     stateE::Exit2Dr        },
+		    /* Exit2DR     */ { stateE::ShiftDr,     stateE::UpdateDr       },
+		    /* UpdateDR    */ { stateE::RunTestIdle, stateE::SelectDrScan   },
+		    /* SelectIR    */ { stateE::CaptureIr,   stateE::TestLogicReset },
+		    /* CaptureIR   */ { stateE::ShiftIr,     stateE::Exit1Ir        },
+		    /* ShiftIR     */ { stateE::ShiftIr,     stateE::Exit1Ir        },
+		    /* Exit1IR     */ { stateE::PauseIr,     stateE::UpdateIr       },
+		    /* PauseIR     */ { stateE::PauseIr,     stateE::Exit2Ir        },
+		    /* Exit2IR     */ { stateE::ShiftIr,     stateE::UpdateIr       },
+		    /* UpdateIR    */ { stateE::RunTestIdle, stateE::SelectDrScan   }
+		};
+
+
+#ifdef JTAG_IR_CACHE
+		// The IR is reset whenever the TAP passes through the TestLogicReset. The shortest paths go through it even
+		// when it's not their destination (TMS high in the SelectIrScan), so the path is walked bit by bit
+		void invalidateOnReset(stateE from, tmsMove move) {
+		  for (uint32_t i = 0; i < move.amountOfBitsToShift; i++) {
+		    from = nextStates[static_cast<int>(from)][(move.valueToShift >> i) & 1];
+		    if (from == stateE::TestLogicReset) {
+		      irCache::invalidate();
+		      return;
+		    }
+		  }
+		}
+#endif
+
+
+#ifdef JTAG_TAP_LAZY_MOVES
+		// The currentState is always where the TAP really is, the pendingState is where
+		// the TAP should be, but it was not clocked there yet
+		bool   movePending  = false;
+		stateE pendingState = stateE::RunTestIdle;
+#endif
+
+
 		void resetSM() {
 		  bitbang::shiftTms({8, 0b11111111});
 
 		  currentState = stateE::TestLogicReset;
+
+#ifdef JTAG_TAP_LAZY_MOVES
+		  movePending = false;
+#endif
+
+#ifdef JTAG_IR_CACHE
+		  irCache::invalidate();
+#endif
 		}
 
 
@@ -65,14 +118,186 @@ namespace jtag {
 		  auto whatToShift          = tapMoves[currentStateInt][whereToMoveStateInt];
 
 		  bitbang::shiftTms(whatToShift);
+
+#ifdef JTAG_IR_CACHE
+		  invalidateOnReset(currentState, whatToShift);
+#endif
+
 		  currentState = whereToMove;
 
+#ifdef JTAG_TAP_LAZY_MOVES
+		  // Any pending move got merged into this one
+		  movePending = false;
+#endif
+
 #ifdef JTAG_TAP_TELEMETRY
 		  telemetry::statsCallMade(whereToMove);
 #endif
 		}
 
 
+		// Move to the end state after a scan. With the lazy moves, the RunTestIdle after a Shift-xR is not
+		// clocked fully, the TAP is moved only to the Update-xR (so the scan takes the effect) and the
+		// rest is left pending. The next move then goes from the Update-xR directly to its destination
+		void endStateMove(stateE endState) {
+#ifdef JTAG_TAP_LAZY_MOVES
+		  if (movePending && pendingState == endState) return;
+
+		  if (endState == stateE::RunTestIdle && (currentState == stateE::ShiftDr || currentState == stateE::ShiftIr)) {
+		    stateMove((currentState == stateE::ShiftDr) ? stateE::UpdateDr : stateE::UpdateIr);
+		    movePending  = true;
+		    pendingState = endState;
+		    return;
+		  }
+#endif
+
+		  if (currentState != endState) stateMove(endState);
+		}
+
+
+		// Clock the pending move (if there is any), so the TAP is in the state the host expects it to be
+		void flush() {
+#ifdef JTAG_TAP_LAZY_MOVES
+		  if (movePending) stateMove(pendingState);
+#endif
+		}
+
+
+		// Exit path from the shift state (currentState) to the endState, the caller shifts it together with its
+		// last data bit (see the bitbang::shiftTdiFused), a separate stateMove after the data would shift one extra
+		// bit. The currentState is updated right away, the same lazy RunTestIdle handling as in the endStateMove applies
+		tmsMove exitMove(stateE endState) {
+		  auto physicalEnd = endState;
+
+#ifdef JTAG_TAP_LAZY_MOVES
+		  // Exit only to the Update-xR and leave the RunTestIdle pending
+		  const bool deferred = (endState == stateE::RunTestIdle);
+		  if (deferred) {
+		    physicalEnd = (currentState == stateE::ShiftDr) ? stateE::UpdateDr : stateE::UpdateIr;
+		  }
+#endif
+
+		  tmsMove exit = tapMoves[static_cast<int>(currentState)][static_cast<int>(physicalEnd)];
+
+#ifdef JTAG_IR_CACHE
+		  invalidateOnReset(currentState, exit);
+#endif
+
+		  currentState = physicalEnd;
+
+#ifdef JTAG_TAP_LAZY_MOVES
+		  movePending  = deferred;
+		  pendingState = endState;
+#endif
+
+#ifdef JTAG_TAP_TELEMETRY
+		  telemetry::statsCallMade(endState);
+#endif
+
+		  return exit;
+		}
+
+
+		// Move to the ShiftDr/ShiftIr, shift the data and move to the endState in a single kernel
+		// invocation. The first TMS bit of the exit path is shifted together with the last data bit
+		// so leaving the Shift-xR state doesn't cost extra TCK
+		uint32_t fusedScan(stateE shiftState, uint32_t length, uint32_t writeValue, stateE endState) {
+		  if (length == 0) {
+		    // Nothing to shift, just do the moves on their own
+		    stateMove(shiftState);
+		    endStateMove(endState);
+		    return 0;
+		  }
+
+		  // When already in the shift state, do not clock anything as it would shift an extra data bit
+		  tmsMove entry = (currentState == shiftState) ? tmsMove{0, 0} : tapMoves[static_cast<int>(currentState)][static_cast<int>(shiftState)];
+
+#ifdef JTAG_IR_CACHE
+		  invalidateOnReset(currentState, entry);
+#endif
+
+		  currentState  = shiftState;
+
+#ifdef JTAG_TAP_TELEMETRY
+		  telemetry::statsCallMade(shiftState);
+#endif
+
+		  tmsMove exit = exitMove(endState);
+		  return bitbang::shiftTdiFused(entry, length, writeValue, exit);
+		}
+
+
+		// Raw TMS/TDI vectors from the host, the host is responsible for the state machine, but the currentState
+		// is still followed through the TMS bits, so the regular commands can continue after the vectors
+		void vectorShift(uint32_t length, const uint32_t *tmsBuffer, const uint32_t *tdiBuffer, uint32_t *readBuffer) {
+		  flush(); // The host expects the TAP to be where the previous command left it
+
+		  bitbang::shiftVector(length, tmsBuffer, tdiBuffer, readBuffer);
+
+		  for (uint32_t i = 0; i < length; i++) {
+		    const uint32_t tms = (tmsBuffer[i / 32] >> (i % 32)) & 1;
+		    currentState = nextStates[static_cast<int>(currentState)][tms];
+		  }
+
+#ifdef JTAG_IR_CACHE
+		  // Whatever the vectors shifted into the IR is not known
+		  irCache::invalidate();
+#endif
+
+#ifdef JTAG_TAP_TELEMETRY
+		  telemetry::statsCallMade(currentState);
+#endif
+		}
+
+
+#ifdef JTAG_IR_CACHE
+		namespace irCache {
+
+		  // Last instruction shifted into the IR, it's valid only until something resets the TAP
+		  bool     valid        = false;
+		  uint32_t cachedValue  = 0;
+		  uint32_t cachedLength = 0;
+
+
+		  uint32_t lengthMask(uint32_t length) {
+		    return (length >= 32) ? 0xffff'ffff : ((1u << length) - 1);
+		  }
+
+
+		  bool isHit(uint32_t value, uint32_t length) {
+		    bool hit = valid && (length == cachedLength) && ((value & lengthMask(length)) == cachedValue);
+
+#ifdef JTAG_TAP_TELEMETRY
+		    telemetry::statsIrCache(hit);
+#endif
+		    return hit;
+		  }
+
+
+		  void update(uint32_t value, uint32_t length) {
+		    valid        = true;
+		    cachedValue  = value & lengthMask(length);
+		    cachedLength = length;
+		  }
+
+
+		  // The IR scans which capture the IR can't be skipped, they are counted as the misses
+		  void shifted(uint32_t value, uint32_t length) {
+#ifdef JTAG_TAP_TELEMETRY
+		    telemetry::statsIrCache(false);
+#endif
+		    update(value, length);
+		  }
+
+
+		  void invalidate() {
+		    valid = false;
+		  }
+
+		}
+#endif
+
+
 #ifdef JTAG_TAP_TELEMETRY
 		namespace telemetry {
 
@@ -122,6 +347,9 @@ namespace jtag {
 
       std::array<stats_entry_s, tap::stateESize> statsEntries = { 0 };
 
+      uint32_t irCacheHits   = 0;
+      uint32_t irCacheMisses = 0;
+
 
       void displayStateMachineDiagram() {
         for (auto entry: displayEntries) {
@@ -146,11 +374,22 @@ namespace jtag {
       }
 
 
+      void statsIrCache(bool isHit) {
+        if (isHit) {
+          irCacheHits++;
+        } else {
+          irCacheMisses++;
+        }
+      }
+
+
       void statsClearAll() {
         for (int i=0; i<tap::stateESize; i++) {
           statsEntries[i].calls = 0;
           statsEntries[i].time  = 0;
         }
+        irCacheHits   = 0;
+        irCacheMisses = 0;
       }
 
 
@@ -180,6 +419,14 @@ namespace jtag {
           BSP_LCD_DrawHLine(diagramEntry.x -2, diagramEntry.y + fontHeight + 2 + 1, lineSize);
         }
 
+#ifdef JTAG_IR_CACHE
+        char buf[40];
+        sprintf(buf, "IR cache hit %lu miss %lu", irCacheHits, irCacheMisses);
+
+        BSP_LCD_SetBackColor(LCD_COLOR_WHITE);
+        BSP_LCD_SetTextColor(LCD_COLOR_BLACK);
+        BSP_LCD_DisplayString(rowFirstX, 10 * lineHeight, buf);
+#endif
       }
 
 		}
@@ -53,13 +53,35 @@ namespace jtag {
     };
 
 
+    extern tmsMove tapMoves[stateESize][stateESize];
+
+
     void resetSM(void);
     void stateMove(stateE whereToMove);
+    void endStateMove(stateE endState);
+    void flush(void);
+    tmsMove exitMove(stateE endState);
+    uint32_t fusedScan(stateE shiftState, uint32_t length, uint32_t writeValue, stateE endState);
+    void vectorShift(uint32_t length, const uint32_t *tmsBuffer, const uint32_t *tdiBuffer, uint32_t *readBuffer);
+
+#ifdef JTAG_IR_CACHE
+    namespace irCache {
+      bool isHit(uint32_t value, uint32_t length);
+
+      void update(uint32_t value, uint32_t length);
+
+      void shifted(uint32_t value, uint32_t length);
+
+      void invalidate(void);
+    }
+#endif
 
 #ifdef JTAG_TAP_TELEMETRY
     namespace telemetry {
       void statsCallMade(tap::stateE state);
 
+      void statsIrCache(bool isHit);
+
       void displayStateMachineDiagram(void);
 
       void statsDisplayCallsAndTime(void);
@@ -6,10 +6,22 @@
  */
 
 
+#include <algorithm>
 #include <array>
+#include <cstdio>
+#include <cstring>
 
 #include "usb.hpp"
 #include "api.hpp"
+#include "tap.hpp"
+#include "spsc_ring.hpp"
+
+#include "usb_device.h"
+#include "usbd_hid_bulk.h"
+
+#if defined(JTAG_USB_DISPATCH_BENCHMARK) || defined(JTAG_USB_STATS)
+#include "stm32f429i_discovery_lcd.h"
+#endif
 
 
 namespace jtag {
@@ -18,19 +30,19 @@ namespace jtag {
 
     bool processBuffer = true;
 
-    requestAndResponse parseQueue(uint32_t *req, uint32_t *res) {
+    requestAndResponse parseQueueLoop(uint32_t *req, uint32_t *res) {
       // Handling only non-zero buffers means that I can read the first group of commandIDs blindly
       uint32_t commandIds = *req; // The 32-bit value contains four 8-bit command IDs
 
+      // Advance the pointer in the request stream, so the invoked functions
+      // will already have request stream pointing to their arguments (and not their commandId)
+      req++;
+
       // Repeat while still we have some IDs in the combined ID (NOP is ID=0, multiple NOPs are still 0)
       while (commandIds) {
         uint8_t commandId = commandIds & 0xff;  // take only the lowest 8-bit from the IDs
         commandIds = commandIds >> 8;           // move the IDs so next time the next 8-bits can be loaded
 
-        // Advance the pointer in the request stream, so the invoked functions
-        // will already have request stream pointing to their arguments (and not their commandId)
-        req++;
-
         // Invoke the command from the API function table
         requestAndResponse combined = jtag::api::handlers[commandId](req, res);
 
@@ -44,6 +56,423 @@ namespace jtag {
     }
 
 
+#ifdef JTAG_USB_THREADED_DISPATCH
+
+    requestAndResponse parseQueueThreaded(uint32_t *req, uint32_t *res) {
+      // Same semantics as the parseQueueLoop, but only the first handler is invoked from here,
+      // all the following ones are tail-called by the handler before them
+      uint32_t commandIds = *req;
+      req++;
+
+      if (commandIds == 0) return JTAG_COMBINE_REQ_RES(req, res);
+
+      return jtag::api::threadedHandlers[commandIds & 0xff](req, res, commandIds >> 8);
+    }
+
+#endif
+
+
+    requestAndResponse parseQueue(uint32_t *req, uint32_t *res) {
+#ifdef JTAG_USB_THREADED_DISPATCH
+      return parseQueueThreaded(req, res);
+#else
+      return parseQueueLoop(req, res);
+#endif
+    }
+
+
+    // The reports flow through two rings: the USB IRQ only copies the OUT report into the request ring,
+    // the main loop executes it and puts its response into the response ring, from where it's sent through
+    // the IN endpoint. No JTAG is executed in the IRQ, so a long runTest or a scan can't block the enumeration,
+    // control requests or receiving of the next OUT report. The OUT endpoint is re-armed only when the request
+    // ring has a free entry, until then the host gets NAKs (back-pressure toward the host).
+    struct requestEntryS {
+      uint32_t words[JTAG_USB_REPORT_WORDS + 1];  // one extra zero word, so the parser always ends on a zero
+#ifdef JTAG_USB_STATS
+      uint32_t receivedAt;                        // DWT cycles
+#endif
+    };
+
+
+    struct responseEntryS {
+      uint32_t words[JTAG_USB_REPORT_WORDS];      // one whole frame (header + payload)
+    };
+
+
+    // Each HID report (in both directions) is a frame, the first word is the header and the rest is payload.
+    // Consecutive OUT frames with the continued flag form one batch, the payloads are joined into one
+    // continuous request stream, so a command (or its arguments) can cross the report boundaries. The batch
+    // executes once its last frame (without the continued flag) arrives. Its responses are sent the same way,
+    // as one or more IN frames, the last one without the continued flag. It's store-and-forward, nothing
+    // is executed until the whole batch is buffered, so a batch can't exceed JTAG_USB_STREAM_SIZE (4KB) of
+    // joined payload. A larger batch is answered only with the overflow flag and the host has to split it.
+    struct frameHeaderS {
+      uint8_t  sequence;  // incremented with each frame, the OUT and IN directions have their own counters
+      uint8_t  flags;     // frameFlagsE
+      uint16_t length;    // used payload bytes in this frame
+    };
+
+    static_assert(sizeof(frameHeaderS) == sizeof(uint32_t), "The frame header has to be exactly one word");
+
+
+    enum frameFlagsE:uint8_t {
+      continued     = 1 << 0, // more frames of the same batch follow
+      sequenceError = 1 << 1, // IN only, an OUT frame was lost or out of order, the batch was dropped
+      overflow      = 1 << 2, // IN only, batch too large (over JTAG_USB_STREAM_SIZE), nothing of it was executed,
+                                // the host should split it on the command group boundaries and send the parts again
+      rejected      = 1 << 3  // IN only, some command didn't fit the request or response of the batch, it was skipped
+    };
+
+
+    uint32_t streamRequest[JTAG_USB_STREAM_WORDS + 1];  // one extra zero word, so the parser always ends on a zero
+    uint32_t streamResponse[JTAG_USB_STREAM_WORDS * 2]; // some space for commands responding more than they requested, each
+                                                        // responder checks what is left and is rejected when it doesn't fit
+
+    bool     inBatch        = false;  // some continued frames were already received
+    uint8_t  outSequence    = 0;      // expected sequence of the next OUT frame inside a batch
+    uint8_t  inSequence     = 0;
+    uint8_t  streamFlags    = 0;      // errors of the batch being received
+    uint32_t streamLength   = 0;      // in bytes
+
+    bool     responsePending = false; // the response stream is not fully split into frames yet
+    uint8_t  responseFlags   = 0;
+    uint32_t responseLength  = 0;     // in bytes
+    uint32_t responseQueued  = 0;     // in bytes
+
+
+    spscRingS<requestEntryS,  JTAG_USB_REPORT_SLOTS> requests;   // USB IRQ -> main loop
+    spscRingS<responseEntryS, JTAG_USB_REPORT_SLOTS> responses;  // main loop -> IN endpoint
+
+    volatile bool receiveArmed = true;   // the class arms the OUT endpoint on its own after the enumeration
+    bool          responseInFlight = false;
+
+
+    // The vendor bulk interface carries the same request stream as the joined HID frames, but without
+    // the frame headers, the USB transfer itself is the batch, up to JTAG_USB_BULK_SIZE (4KB). The device
+    // can't tell a longer transfer from two, so the host has to split it itself. The ID groups are executed until a zero
+    // ID group or the end of the transfer. All the responses are sent back as one transfer.
+    // The IRQ only marks the transfer as pending, it's executed from the main loop as well. Only after
+    // the response was sent the OUT endpoint is re-armed, until then the host gets NAKs. When the IN
+    // endpoint can't take the response yet, it stays pending and the main loop retries it.
+    uint32_t bulkRequest[JTAG_USB_BULK_WORDS + 1];  // one extra zero word, so the parser always ends on a zero
+    uint32_t bulkResponse[JTAG_USB_BULK_WORDS * 2]; // same headroom as the HID stream has, the responders are bounded by its end
+                                                    // the same way, there are no flags, a rejected command just responds nothing
+
+    volatile uint32_t bulkLength          = 0;
+    volatile bool     bulkPending         = false;
+    volatile bool     bulkResponsePending = false;
+    uint32_t          bulkResponseLength  = 0;
+
+
+#ifdef JTAG_USB_STATS
+    struct statsS {
+      uint32_t reports;
+      uint32_t commands;
+      uint32_t cyclesTotal; // DWT cycles from receiving the last OUT report of a batch to having its response executed
+      uint32_t cyclesMax;
+      uint32_t startTick;
+    };
+
+    statsS stats = {};
+#endif
+
+
+    void init() {
+      // Enable the DWT cycle counter, used for the statistics and benchmarks
+      CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+      DWT->CYCCNT       = 0;
+      DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+
+
+    bool isInEndpointIdle() {
+      auto hhid = static_cast<USBD_CUSTOM_HID_HandleTypeDef *>(hUsbDeviceHS.pClassData);
+      return (hhid != nullptr) && (hhid->state == CUSTOM_HID_IDLE);
+    }
+
+
+    // Invoked from the USB IRQ when the OUT report arrived, it's only copied, nothing is executed here
+    void reportReceived(const uint8_t *report) {
+      // The OUT endpoint is armed only when the request ring has a free entry
+      auto &entry = requests.back();
+      memcpy(entry.words, report, JTAG_USB_REPORT_SIZE);
+      entry.words[JTAG_USB_REPORT_WORDS] = 0;
+#ifdef JTAG_USB_STATS
+      entry.receivedAt = DWT->CYCCNT;
+#endif
+      requests.push();
+
+      if (requests.isFull()) {
+        // Re-armed by the main loop after it consumes an entry
+        receiveArmed = false;
+      } else {
+        USBD_CUSTOM_HID_ReceivePacket(&hUsbDeviceHS);
+      }
+    }
+
+
+    // Executes back to back ID groups (each followed by its arguments) until a zero ID group or the end,
+    // returns where the response stream ended
+    uint32_t *parseStream(uint32_t *req, uint32_t *end, uint32_t *res, uint32_t *resEnd) {
+      *end = 0;
+      api::batchStart(end, resEnd);
+
+      while (req < end && *req) {
+#ifdef JTAG_USB_STATS
+        for (uint32_t commandIds = *req; commandIds; commandIds >>= 8) {
+          stats.commands++;
+        }
+#endif
+        requestAndResponse combined = parseQueue(req, res);
+        JTAG_DECOMPOSE_REQ_RES(combined, req, res);
+      }
+
+      // Any deferred TAP move is clocked once the whole stream is done (the commands in the middle of the
+      // stream merge it into their own moves), so the host sees the same end state before the response is sent back
+      tap::flush();
+      return res;
+    }
+
+
+    // Main loop, splits the response stream into IN frames while there is space in the response ring,
+    // returns true when the whole response is queued
+    bool queueResponseFrames() {
+      while (responsePending && !responses.isFull()) {
+        auto &frame  = responses.back();
+        auto  header = reinterpret_cast<frameHeaderS *>(frame.words);
+
+        const uint32_t length = std::min<uint32_t>(responseLength - responseQueued, JTAG_USB_FRAME_PAYLOAD);
+        responseQueued += length;
+
+        memset(frame.words, 0, sizeof(frame.words));
+        header->sequence = inSequence++;
+        header->flags    = responseFlags | ((responseQueued < responseLength) ? frameFlagsE::continued : 0);
+        header->length   = length;
+        memcpy(&frame.words[1], reinterpret_cast<uint8_t *>(streamResponse) + responseQueued - length, length);
+
+        responses.push();
+        if (responseQueued >= responseLength) responsePending = false; // even empty response gets one frame
+      }
+
+      return !responsePending;
+    }
+
+
+    // Main loop, appends the frame to the request stream and executes the batch when it was its last frame
+    void receiveFrame(const requestEntryS &request) {
+      auto header = reinterpret_cast<const frameHeaderS *>(request.words);
+
+      // A new batch can start with any sequence, so the host doesn't need to know the device's state
+      if (inBatch && header->sequence != outSequence) streamFlags |= frameFlagsE::sequenceError;
+      outSequence = header->sequence + 1;
+
+      const uint32_t length = std::min<uint32_t>(header->length, JTAG_USB_FRAME_PAYLOAD);
+      if (streamLength + length > JTAG_USB_STREAM_SIZE) streamFlags |= frameFlagsE::overflow;
+
+      if (!streamFlags) {
+        memcpy(reinterpret_cast<uint8_t *>(streamRequest) + streamLength, &request.words[1], length);
+        streamLength += length;
+      }
+
+      if (header->flags & frameFlagsE::continued) {
+        inBatch = true;
+        return;
+      }
+
+      // Last frame of the batch, broken batches are not executed at all, only their flags are responded
+      uint32_t *res = streamResponse;
+      if (!streamFlags) {
+        res = parseStream(streamRequest, streamRequest + streamLength / 4, streamResponse, std::end(streamResponse));
+        if (api::batchRejected()) streamFlags |= frameFlagsE::rejected;
+      }
+
+      responsePending = true;
+      responseFlags   = streamFlags;
+      responseLength  = (res - streamResponse) * 4;
+      responseQueued  = 0;
+
+      inBatch      = false;
+      streamFlags  = 0;
+      streamLength = 0;
+
+#ifdef JTAG_USB_STATS
+      const uint32_t cycles = DWT->CYCCNT - request.receivedAt;
+      stats.cyclesTotal += cycles;
+      if (cycles > stats.cyclesMax) stats.cyclesMax = cycles;
+#endif
+    }
+
+
+    // Main loop, executes the received reports, but only when the previous batch has all its responses queued
+    void executeReports() {
+      while (queueResponseFrames() && !requests.isEmpty()) {
+        receiveFrame(requests.front());
+        requests.pop();
+
+#ifdef JTAG_USB_STATS
+        stats.reports++;
+#endif
+
+        // The IRQ can't run reportReceived while the endpoint is not armed, so the flag is stable here,
+        // the IRQs are disabled only so the endpoint registers are not touched from two contexts at once
+        if (!receiveArmed) {
+          __disable_irq();
+          receiveArmed = true;
+          USBD_CUSTOM_HID_ReceivePacket(&hUsbDeviceHS);
+          __enable_irq();
+        }
+      }
+    }
+
+
+    // Main loop, sends the responses in order, the entry stays in the ring until its transfer is finished
+    void sendResponses() {
+      if (responseInFlight && isInEndpointIdle()) {
+        responseInFlight = false;
+        responses.pop();
+      }
+
+      if (!responseInFlight && !responses.isEmpty() && isInEndpointIdle()) {
+        responseInFlight = true;
+        __disable_irq();
+        USBD_CUSTOM_HID_SendReport(&hUsbDeviceHS, reinterpret_cast<uint8_t *>(responses.front().words), JTAG_USB_REPORT_SIZE);
+        __enable_irq();
+      }
+    }
+
+
+    // Invoked from the USB IRQ (class init and IN transfer completion)
+    void bulkArm() {
+      bulkResponsePending = false; // after a re-enumeration a stale response would confuse the new host
+      USBD_HID_BULK_Receive(&hUsbDeviceHS, reinterpret_cast<uint8_t *>(bulkRequest), JTAG_USB_BULK_SIZE);
+    }
+
+
+    // Invoked from the USB IRQ when the whole OUT transfer arrived
+    void bulkReceived(const uint8_t *buf, uint32_t length) {
+      (void)buf; // always the bulkRequest
+      bulkLength  = length;
+      bulkPending = true;
+    }
+
+
+    // Main loop, executes the pending bulk transfer and sends all its responses
+    void executeBulk() {
+      if (bulkPending) {
+        uint32_t *res = parseStream(bulkRequest, bulkRequest + bulkLength / 4, bulkResponse, std::end(bulkResponse));
+
+        bulkResponseLength  = (res - bulkResponse) * 4;
+        bulkResponsePending = true;
+        bulkPending         = false;
+      }
+
+      if (!bulkResponsePending) return;
+
+      // A busy (or not yet configured) IN endpoint keeps the response pending, it's retried on the next
+      // poll, dropping it would leave the OUT endpoint never re-armed as only bulkSent re-arms it
+      __disable_irq();
+      if (bulkResponsePending &&
+          USBD_HID_BULK_Transmit(&hUsbDeviceHS, reinterpret_cast<uint8_t *>(bulkResponse), bulkResponseLength) == USBD_OK) {
+        bulkResponsePending = false;
+      }
+      __enable_irq();
+    }
+
+
+    // Invoked from the USB IRQ when the whole IN transfer was sent
+    void bulkSent() {
+      bulkArm();
+    }
+
+
+#ifdef JTAG_USB_STATS
+    void statsDisplay() {
+      const uint32_t elapsed = HAL_GetTick() - stats.startTick; // ms
+      if (elapsed < 1000) return;
+
+      char buf[40];
+      const uint32_t cyclesPerUs = SystemCoreClock / 1'000'000;
+      const uint32_t reports     = (stats.reports) ? stats.reports : 1;
+
+      BSP_LCD_SetBackColor(LCD_COLOR_WHITE);
+      BSP_LCD_SetTextColor(LCD_COLOR_BLACK);
+
+      sprintf(buf, "USB %lu cmd/s %lu rep/s", (stats.commands * 1000) / elapsed, (stats.reports * 1000) / elapsed);
+      BSP_LCD_DisplayString(5, 250, buf);
+
+      sprintf(buf, "Latency avg %luus max %luus", stats.cyclesTotal / reports / cyclesPerUs, stats.cyclesMax / cyclesPerUs);
+      BSP_LCD_DisplayString(5, 260, buf);
+
+      stats = {};
+      stats.startTick = HAL_GetTick();
+    }
+#endif
+
+
+    // Invoked from the main loop, all the JTAG execution happens from here
+    void poll() {
+      executeReports();
+      sendResponses();
+      executeBulk();
+
+#ifdef JTAG_USB_STATS
+      statsDisplay();
+#endif
+    }
+
+
+#ifdef JTAG_USB_DISPATCH_BENCHMARK
+
+    // Commands which are not touching the JTAG pins, so only the dispatch overhead is measured:
+    // stateMove(RunTestIdle), setIrOpcodeLen(4), setDrOpcodeLen(32), ping (these are the defaults anyway)
+    const uint32_t benchmarkRequest[] = {
+        static_cast<uint32_t>(api::commandE::stateMove)             |
+        static_cast<uint32_t>(api::commandE::setIrOpcodeLen) << 8   |
+        static_cast<uint32_t>(api::commandE::setDrOpcodeLen) << 16  |
+        static_cast<uint32_t>(api::commandE::ping)           << 24,
+        static_cast<uint32_t>(tap::stateE::RunTestIdle),
+        4,
+        32
+    };
+
+
+    template<requestAndResponse (*PARSER)(uint32_t *req, uint32_t *res)>
+    uint32_t benchmarkCycles(uint32_t iterations) {
+      uint32_t request[sizeof(benchmarkRequest) / sizeof(uint32_t)];
+      uint32_t response[JTAG_USB_REPORT_WORDS];
+
+      for (uint32_t i = 0; i < sizeof(benchmarkRequest) / sizeof(uint32_t); i++) {
+        request[i] = benchmarkRequest[i];
+      }
+
+      const uint32_t start = DWT->CYCCNT;
+      for (uint32_t i = 0; i < iterations; i++) {
+        PARSER(request, response);
+      }
+      return DWT->CYCCNT - start;
+    }
+
+
+    void dispatchBenchmark() {
+      const uint32_t iterations = 10000;
+
+      const uint32_t loopCycles     = benchmarkCycles<parseQueueLoop>(iterations);
+      const uint32_t threadedCycles = benchmarkCycles<parseQueueThreaded>(iterations);
+
+      // Cycles per one request with 4 commands (fixed point with 2 decimal places)
+      char buf[40];
+      BSP_LCD_SetBackColor(LCD_COLOR_WHITE);
+      BSP_LCD_SetTextColor(LCD_COLOR_BLACK);
+
+      sprintf(buf, "Loop     %lu.%02lu clk/req", loopCycles / iterations, (loopCycles % iterations) / (iterations / 100));
+      BSP_LCD_DisplayString(5, 290, buf);
+
+      sprintf(buf, "Threaded %lu.%02lu clk/req", threadedCycles / iterations, (threadedCycles % iterations) / (iterations / 100));
+      BSP_LCD_DisplayString(5, 300, buf);
+    }
+
+#endif
+
   }
 }
 
@@ -24,6 +24,22 @@ namespace jtag {
 
     requestAndResponse parseQueue(uint32_t *req, uint32_t *res);
 
+    void init(void);
+
+    void reportReceived(const uint8_t *report);
+
+    void bulkArm(void);
+
+    void bulkReceived(const uint8_t *buf, uint32_t length);
+
+    void bulkSent(void);
+
+    void poll(void);
+
+#ifdef JTAG_USB_DISPATCH_BENCHMARK
+    void dispatchBenchmark(void);
+#endif
+
   }
 }
 
@@ -0,0 +1,271 @@
+/*
+ * Timer + DMA driven waveform backend for the long shifts
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: agent@local
+ *     License: GPLv2
+ */
+
+#include <cstdint>
+#include <algorithm>
+
+#include "waveform.hpp"
+#include "bitbang.hpp"
+
+#include "main.h"
+#include "jtag_global.h"
+
+
+#ifdef JTAG_WAVEFORM
+
+namespace jtag {
+
+  namespace waveform {
+
+    // Each TCK is made of two BSRR words (low part with the TDI value, high part), every TIM1 update event
+    // makes the DMA2 Stream5 (channel 6, TIM1_UP) to write the next word into the GPIOE BSRR. The TIM1
+    // compare 1 event makes the DMA2 Stream1 (channel 6, TIM1_CH1) to sample the GPIOE IDR late in each
+    // part, the samples of the high parts hold the TDO bits. Only the BSRR bits of TCK/TMS/TDI are
+    // touched, the nTRST keeps whatever the bit-bang kernels left there. The IRQs stay enabled all the
+    // time, while one chunk is on the wire the CPU unpacks the previous one and packs the next one.
+    // JTAG is static, the short TCK pause between the chunks (while the DMA streams are re-armed) is fine
+    // The whole shift stays in the Shift-xR, the caller shifts the last bit of the scan with the exit path
+
+    static_assert(JTAG_WAVEFORM_CHUNK % 32 == 0, "Chunks have to be whole words of the scan");
+
+    const uint32_t CHUNK       = JTAG_WAVEFORM_CHUNK;
+    const uint32_t MIN_RELOAD  = 3;   // Fastest reload the calibration tries (4 timer ticks per TCK part)
+    const uint32_t MAX_RELOAD  = 255; // Slowest calibrated speed, anything slower is left to the bit-bang kernels
+    const uint32_t DMA_CHANNEL = 6;
+
+    const uint32_t LOW_PART    = (JTAG_TCK_Pin | JTAG_TMS_Pin) << 16; // Reset TCK and TMS, TDI set/reset added per bit
+    const uint32_t HIGH_PART   = JTAG_TCK_Pin;
+
+
+    uint32_t bsrrWords[2][2 * CHUNK];  // Double buffered, one is on the wire while the other one is packed
+    uint16_t samples[2][2 * CHUNK];
+
+    uint32_t threshold    = 0;         // 0 = backend not selected for any scan
+    uint32_t stableReload = 0;         // The fastest TIM1 reload which passed the calibration
+
+
+    struct timerStateS {
+      uint32_t cr1;
+      uint32_t dier;
+      uint32_t psc;
+      uint32_t arr;
+      uint32_t ccr1;
+    };
+
+    timerStateS savedTimer;
+
+
+    uint32_t timerClock() {
+      // APB2 timers run at twice the PCLK2 when the APB2 is divided
+      const uint32_t pclk2 = HAL_RCC_GetPCLK2Freq();
+      return (RCC->CFGR & RCC_CFGR_PPRE2_2) ? 2 * pclk2 : pclk2;
+    }
+
+
+    uint32_t reloadToFrequency(uint32_t reload) {
+      return timerClock() / (2 * (reload + 1));
+    }
+
+
+    // The TIM1 is borrowed from its slow periodic IRQ for the duration of the shift
+    void timerBegin(uint32_t reload) {
+      savedTimer = { TIM1->CR1, TIM1->DIER, TIM1->PSC, TIM1->ARR, TIM1->CCR1 };
+
+      __HAL_RCC_DMA2_CLK_ENABLE();
+
+      TIM1->CR1  &= ~TIM_CR1_CEN;
+      TIM1->DIER  = 0;
+      TIM1->PSC   = 0;
+      TIM1->ARR   = reload;
+      TIM1->CCR1  = reload - reload / 4; // Sample at 3/4 of each part, the TDO settled and the next write is not out yet
+      TIM1->EGR   = TIM_EGR_UG;
+      TIM1->SR    = 0;
+    }
+
+
+    void timerEnd() {
+      TIM1->CR1  &= ~TIM_CR1_CEN;
+      TIM1->DIER  = 0;
+      TIM1->PSC   = savedTimer.psc;
+      TIM1->ARR   = savedTimer.arr;
+      TIM1->CCR1  = savedTimer.ccr1;
+      TIM1->EGR   = TIM_EGR_UG;
+      TIM1->SR    = 0;
+      TIM1->DIER  = savedTimer.dier;
+      TIM1->CR1   = savedTimer.cr1;
+    }
+
+
+    void pack(uint32_t *words, const uint32_t *writeBuffer, uint32_t first, uint32_t count) {
+      for (uint32_t i = 0; i < count; i++) {
+        const uint32_t bit = first + i;
+        const bool     tdi = (writeBuffer[bit / 32] >> (bit % 32)) & 1;
+
+        words[2 * i]     = LOW_PART | ((tdi) ? JTAG_TDI_Pin : JTAG_TDI_Pin << 16);
+        words[2 * i + 1] = HIGH_PART;
+      }
+    }
+
+
+    void unpack(const uint16_t *captured, uint32_t *readBuffer, uint32_t first, uint32_t count) {
+      // The chunks are whole words, so each chunk starts at a fresh read word
+      for (uint32_t i = 0; i < count; i++) {
+        const uint32_t bit  = first + i;
+        const uint32_t mask = 1u << (bit % 32);
+
+        if (mask == 1) readBuffer[bit / 32] = 0;
+        if (captured[2 * i + 1] & JTAG_TDO_Pin) readBuffer[bit / 32] |= mask;
+      }
+    }
+
+
+    void chunkStart(const uint32_t *words, uint16_t *captured, uint32_t count) {
+      // The first part is written by the CPU, the first update event then writes the second one
+      GPIOE->BSRR = words[0];
+
+      DMA2_Stream5->CR = 0;
+      DMA2_Stream1->CR = 0;
+      while ((DMA2_Stream5->CR | DMA2_Stream1->CR) & DMA_SxCR_EN);
+
+      DMA2->HIFCR = DMA_HIFCR_CTCIF5 | DMA_HIFCR_CHTIF5 | DMA_HIFCR_CTEIF5 | DMA_HIFCR_CDMEIF5 | DMA_HIFCR_CFEIF5;
+      DMA2->LIFCR = DMA_LIFCR_CTCIF1 | DMA_LIFCR_CHTIF1 | DMA_LIFCR_CTEIF1 | DMA_LIFCR_CDMEIF1 | DMA_LIFCR_CFEIF1;
+
+      // Memory to GPIOE BSRR, words
+      DMA2_Stream5->PAR  = reinterpret_cast<uint32_t>(&GPIOE->BSRR);
+      DMA2_Stream5->M0AR = reinterpret_cast<uint32_t>(&words[1]);
+      DMA2_Stream5->NDTR = 2 * count - 1;
+      DMA2_Stream5->CR   = (DMA_CHANNEL << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL_1 | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 |
+                           DMA_SxCR_MINC | DMA_SxCR_DIR_0;
+
+      // GPIOE IDR to memory, half-words, the capture has the highest priority so it doesn't drift
+      DMA2_Stream1->PAR  = reinterpret_cast<uint32_t>(&GPIOE->IDR);
+      DMA2_Stream1->M0AR = reinterpret_cast<uint32_t>(captured);
+      DMA2_Stream1->NDTR = 2 * count;
+      DMA2_Stream1->CR   = (DMA_CHANNEL << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL | DMA_SxCR_MSIZE_0 | DMA_SxCR_PSIZE_0 |
+                           DMA_SxCR_MINC;
+
+      DMA2_Stream5->CR  |= DMA_SxCR_EN;
+      DMA2_Stream1->CR  |= DMA_SxCR_EN;
+
+      TIM1->CNT   = 0;
+      TIM1->SR    = 0;
+      TIM1->DIER  = TIM_DIER_UDE | TIM_DIER_CC1DE;
+      TIM1->CR1  |= TIM_CR1_CEN;
+    }
+
+
+    void chunkWait() {
+      // The last sample is taken in the last high part, the IRQs (USB) are serviced while waiting
+      while (!(DMA2->LISR & DMA_LISR_TCIF1));
+
+      TIM1->CR1  &= ~TIM_CR1_CEN;
+      TIM1->DIER  = 0;
+      DMA2_Stream5->CR = 0;
+      DMA2_Stream1->CR = 0;
+    }
+
+
+    void shiftWithReload(uint32_t reload, uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer) {
+      const uint32_t chunks = (length + CHUNK - 1) / CHUNK;
+
+      timerBegin(reload);
+      pack(bsrrWords[0], writeBuffer, 0, std::min(length, CHUNK));
+
+      for (uint32_t chunk = 0; chunk < chunks; chunk++) {
+        const uint32_t first = chunk * CHUNK;
+        const uint32_t count = std::min(length - first, CHUNK);
+
+        chunkStart(bsrrWords[chunk & 1], samples[chunk & 1], count);
+
+        // While this chunk is on the wire, finish the previous one and prepare the next one
+        if (chunk > 0 && readBuffer != nullptr) {
+          unpack(samples[(chunk - 1) & 1], readBuffer, first - CHUNK, CHUNK);
+        }
+
+        if (chunk + 1 < chunks) {
+          const uint32_t nextFirst = first + CHUNK;
+          pack(bsrrWords[(chunk + 1) & 1], writeBuffer, nextFirst, std::min(length - nextFirst, CHUNK));
+        }
+
+        chunkWait();
+      }
+
+      if (readBuffer != nullptr) {
+        const uint32_t lastFirst = (chunks - 1) * CHUNK;
+        unpack(samples[(chunks - 1) & 1], readBuffer, lastFirst, length - lastFirst);
+      }
+
+      timerEnd();
+    }
+
+
+    bool isStable(uint32_t reload) {
+      // The IDR reflects the output pins as well, each sample has to see the TCK/TDI of its own part,
+      // if the DMA couldn't keep up with the timer, some write landed late and a sample sees a stale part
+      uint32_t pattern[CHUNK / 32];
+      for (uint32_t i = 0; i < CHUNK / 32; i++) {
+        pattern[i] = 0x5a3c'96e1 ^ (i * 0x0101'0101);
+      }
+
+      shiftWithReload(reload, CHUNK, pattern, nullptr);
+
+      const uint16_t *captured = samples[0];
+      for (uint32_t i = 0; i < CHUNK; i++) {
+        const bool tdi = (pattern[i / 32] >> (i % 32)) & 1;
+
+        const bool lowOk  = !(captured[2 * i]     & JTAG_TCK_Pin) && (((captured[2 * i]     & JTAG_TDI_Pin) != 0) == tdi);
+        const bool highOk =  (captured[2 * i + 1] & JTAG_TCK_Pin) && (((captured[2 * i + 1] & JTAG_TDI_Pin) != 0) == tdi);
+
+        if (!lowOk || !highOk) return false;
+      }
+
+      return true;
+    }
+
+
+    // The TAP has to be in a state where the TCKs with TMS low do no harm (RunTestIdle),
+    // returns the fastest stable TCK in Hz (0 = the backend can't be used and stays disabled)
+    uint32_t setup(uint32_t newThreshold) {
+      threshold    = 0;
+      stableReload = 0;
+
+      if (newThreshold == 0) return 0;
+
+      for (uint32_t reload = MIN_RELOAD; reload <= MAX_RELOAD; reload++) {
+        if (isStable(reload)) {
+          stableReload = reload;
+          threshold    = newThreshold;
+          return reloadToFrequency(reload);
+        }
+      }
+
+      return 0;
+    }
+
+
+    bool isSelected(uint32_t length) {
+      return threshold != 0 && length >= threshold;
+    }
+
+
+    void shiftTdiBuffer(uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer) {
+      if (length == 0) return;
+
+      // Follow the tckSet speed, unless it's faster than what the DMA can do
+      const uint32_t frequency = bitbang::tckGet().frequency;
+      const uint32_t reload    = std::clamp<uint32_t>(timerClock() / (2 * frequency) - 1, stableReload, 0xffff);
+
+      JTAG_SHIFT_TIMMING_START();
+      shiftWithReload(reload, length, writeBuffer, readBuffer);
+      JTAG_SHIFT_TIMMING_END();
+    }
+
+  }
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * waveform.hpp
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: agent@local
+ *     License: GPLv2
+ */
+
+#ifndef SRC_JTAG_WAVEFORM_HPP_
+#define SRC_JTAG_WAVEFORM_HPP_
+
+#include <cstdint>
+
+#include "jtag_global.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+namespace jtag {
+
+  namespace waveform {
+
+#ifdef JTAG_WAVEFORM
+    uint32_t setup(uint32_t threshold);
+
+    bool isSelected(uint32_t length);
+
+    void shiftTdiBuffer(uint32_t length, const uint32_t *writeBuffer, uint32_t *readBuffer);
+#endif
+
+  }
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_JTAG_WAVEFORM_HPP_ */
@@ -160,7 +160,9 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
-    // Do not do anything in the main loop because the firmware will only respond on the USB callbacks
+    // The USB callbacks only queue the received reports, they are executed from here, so the
+    // USB IRQ stays responsive even during long scans
+    jtag_usb_poll();
   }
   /* USER CODE END 3 */
 }
@@ -28,7 +28,7 @@
 #include "usbd_custom_hid_if.h"
 
 /* USER CODE BEGIN Includes */
-
+#include "usbd_hid_bulk.h"
 /* USER CODE END Includes */
 
 /* USER CODE BEGIN PV */
@@ -73,7 +73,7 @@ void MX_USB_DEVICE_Init(void)
   {
     Error_Handler();
   }
-  if (USBD_RegisterClass(&hUsbDeviceHS, &USBD_CUSTOM_HID) != USBD_OK)
+  if (USBD_RegisterClass(&hUsbDeviceHS, &USBD_HID_BULK) != USBD_OK)
   {
     Error_Handler();
   }
@@ -23,7 +23,7 @@
 #include "usbd_custom_hid_if.h"
 
 /* USER CODE BEGIN INCLUDE */
-
+#include "jtag_c_connector.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -32,7 +32,6 @@
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
-uint8_t buffer[USBD_CUSTOMHID_OUTREPORT_BUF_SIZE];
 /* USER CODE END PV */
 
 /** @addtogroup STM32_USB_OTG_DEVICE_LIBRARY
@@ -191,13 +190,9 @@ static int8_t CUSTOM_HID_DeInit_HS(void)
 static int8_t CUSTOM_HID_OutEvent_HS(uint8_t* data)
 {
   /* USER CODE BEGIN 10 */
-//  UNUSED(event_idx);
-//  UN  USED(state);
-  memcpy(buffer, data, 0x40);
-  USBD_CUSTOM_HID_SendReport(&hUsbDeviceHS, buffer, 0x40);
-
-    /* Start next USB packet transfer once data processing is completed */
-  USBD_CUSTOM_HID_ReceivePacket(&hUsbDeviceHS);
+  // Only copies the report into the request ring and re-arms the OUT endpoint when the ring has
+  // space, the commands are executed and responded from the main loop
+  jtag_usb_reportReceived(data);
 
   return (USBD_OK);
   /* USER CODE END 10 */
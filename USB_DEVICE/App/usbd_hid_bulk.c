@@ -0,0 +1,411 @@
+/*
+ * usbd_hid_bulk.c
+ *
+ * The HID interface (0) keeps the frame protocol and the vendor bulk interface (1) carries the whole
+ * command stream in one multi-packet transfer. All HID requests and endpoints are passed to the
+ * USBD_CUSTOM_HID class, only the configuration descriptors and the bulk endpoints are handled here
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: agent@local
+ *     License: GPLv2
+ */
+
+#include "usbd_hid_bulk.h"
+#include "usbd_ctlreq.h"
+#include "jtag_c_connector.h"
+
+
+static uint8_t USBD_HID_BULK_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t USBD_HID_BULK_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t USBD_HID_BULK_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+static uint8_t USBD_HID_BULK_EP0_RxReady(USBD_HandleTypeDef *pdev);
+static uint8_t USBD_HID_BULK_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t USBD_HID_BULK_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
+
+static uint8_t *USBD_HID_BULK_GetFSCfgDesc(uint16_t *length);
+static uint8_t *USBD_HID_BULK_GetHSCfgDesc(uint16_t *length);
+static uint8_t *USBD_HID_BULK_GetOtherSpeedCfgDesc(uint16_t *length);
+static uint8_t *USBD_HID_BULK_GetDeviceQualifierDesc(uint16_t *length);
+
+
+USBD_ClassTypeDef USBD_HID_BULK =
+{
+  USBD_HID_BULK_Init,
+  USBD_HID_BULK_DeInit,
+  USBD_HID_BULK_Setup,
+  NULL, /*EP0_TxSent*/
+  USBD_HID_BULK_EP0_RxReady,
+  USBD_HID_BULK_DataIn,
+  USBD_HID_BULK_DataOut,
+  NULL, /*SOF */
+  NULL,
+  NULL,
+  USBD_HID_BULK_GetHSCfgDesc,
+  USBD_HID_BULK_GetFSCfgDesc,
+  USBD_HID_BULK_GetOtherSpeedCfgDesc,
+  USBD_HID_BULK_GetDeviceQualifierDesc,
+};
+
+
+/* Same HID interface as the USBD_CUSTOM_HID class describes, followed by the vendor bulk interface,
+ * the speeds differ only in the HID polling interval and in the bulk max packet size */
+#define USBD_HID_BULK_CFG_DESC(HID_INTERVAL, BULK_MAX_PACKET)                                                     \
+{                                                                                                                 \
+  0x09,                                               /* bLength: Configuration Descriptor size */                \
+  USB_DESC_TYPE_CONFIGURATION,                        /* bDescriptorType: Configuration */                        \
+  USB_HID_BULK_CONFIG_DESC_SIZ,                       /* wTotalLength: Bytes returned */                          \
+  0x00,                                                                                                           \
+  0x02,                                               /* bNumInterfaces: 2 interfaces (HID + vendor bulk) */      \
+  0x01,                                               /* bConfigurationValue: Configuration value */              \
+  0x00,                                               /* iConfiguration: Index of string descriptor */            \
+  USBD_HID_BULK_ATTRIBUTES,                           /* bmAttributes: according to user configuration */         \
+  USBD_MAX_POWER,                                     /* MaxPower */                                              \
+                                                                                                                  \
+  /************** Descriptor of CUSTOM HID interface ****************/                                            \
+  /* 09 */                                                                                                        \
+  0x09,                                               /* bLength: Interface Descriptor size */                    \
+  USB_DESC_TYPE_INTERFACE,                            /* bDescriptorType: Interface descriptor type */            \
+  0x00,                                               /* bInterfaceNumber: Number of Interface */                 \
+  0x00,                                               /* bAlternateSetting: Alternate setting */                  \
+  0x02,                                               /* bNumEndpoints */                                         \
+  0x03,                                               /* bInterfaceClass: CUSTOM_HID */                           \
+  0x00,                                               /* bInterfaceSubClass : 1=BOOT, 0=no boot */                \
+  0x00,                                               /* nInterfaceProtocol : 0=none, 1=keyboard, 2=mouse */      \
+  0x00,                                               /* iInterface: Index of string descriptor */                \
+  /* 18 */                                                                                                        \
+  0x09,                                               /* bLength: CUSTOM_HID Descriptor size */                   \
+  CUSTOM_HID_DESCRIPTOR_TYPE,                         /* bDescriptorType: CUSTOM_HID */                           \
+  0x11,                                               /* bcdHID: CUSTOM_HID Class Spec release number */          \
+  0x01,                                                                                                           \
+  0x00,                                               /* bCountryCode: Hardware target country */                 \
+  0x01,                                               /* bNumDescriptors */                                       \
+  0x22,                                               /* bDescriptorType */                                       \
+  USBD_CUSTOM_HID_REPORT_DESC_SIZE,                   /* wItemLength: Total length of Report descriptor */        \
+  0x00,                                                                                                           \
+  /* 27 */                                                                                                        \
+  0x07,                                               /* bLength: Endpoint Descriptor size */                     \
+  USB_DESC_TYPE_ENDPOINT,                             /* bDescriptorType: */                                      \
+  CUSTOM_HID_EPIN_ADDR,                               /* bEndpointAddress: Endpoint Address (IN) */               \
+  0x03,                                               /* bmAttributes: Interrupt endpoint */                      \
+  CUSTOM_HID_EPIN_SIZE,                               /* wMaxPacketSize */                                        \
+  0x00,                                                                                                           \
+  HID_INTERVAL,                                       /* bInterval: Polling Interval */                           \
+  /* 34 */                                                                                                        \
+  0x07,                                               /* bLength: Endpoint Descriptor size */                     \
+  USB_DESC_TYPE_ENDPOINT,                             /* bDescriptorType: */                                      \
+  CUSTOM_HID_EPOUT_ADDR,                              /* bEndpointAddress: Endpoint Address (OUT) */              \
+  0x03,                                               /* bmAttributes: Interrupt endpoint */                      \
+  CUSTOM_HID_EPOUT_SIZE,                              /* wMaxPacketSize */                                        \
+  0x00,                                                                                                           \
+  HID_INTERVAL,                                       /* bInterval: Polling Interval */                           \
+  /* 41 */                                                                                                        \
+                                                                                                                  \
+  /************** Descriptor of vendor bulk interface ****************/                                           \
+  0x09,                                               /* bLength: Interface Descriptor size */                    \
+  USB_DESC_TYPE_INTERFACE,                            /* bDescriptorType: Interface descriptor type */            \
+  VENDOR_BULK_INTERFACE,                              /* bInterfaceNumber: Number of Interface */                 \
+  0x00,                                               /* bAlternateSetting: Alternate setting */                  \
+  0x02,                                               /* bNumEndpoints */                                         \
+  0xFF,                                               /* bInterfaceClass: Vendor specific */                      \
+  0x00,                                               /* bInterfaceSubClass */                                    \
+  0x00,                                               /* nInterfaceProtocol */                                    \
+  0x00,                                               /* iInterface: Index of string descriptor */                \
+  /* 50 */                                                                                                        \
+  0x07,                                               /* bLength: Endpoint Descriptor size */                     \
+  USB_DESC_TYPE_ENDPOINT,                             /* bDescriptorType: */                                      \
+  VENDOR_BULK_EPOUT_ADDR,                             /* bEndpointAddress: Endpoint Address (OUT) */              \
+  0x02,                                               /* bmAttributes: Bulk endpoint */                           \
+  LOBYTE(BULK_MAX_PACKET),                            /* wMaxPacketSize */                                        \
+  HIBYTE(BULK_MAX_PACKET),                                                                                        \
+  0x00,                                               /* bInterval: ignored for bulk */                           \
+  /* 57 */                                                                                                        \
+  0x07,                                               /* bLength: Endpoint Descriptor size */                     \
+  USB_DESC_TYPE_ENDPOINT,                             /* bDescriptorType: */                                      \
+  VENDOR_BULK_EPIN_ADDR,                              /* bEndpointAddress: Endpoint Address (IN) */               \
+  0x02,                                               /* bmAttributes: Bulk endpoint */                           \
+  LOBYTE(BULK_MAX_PACKET),                            /* wMaxPacketSize */                                        \
+  HIBYTE(BULK_MAX_PACKET),                                                                                        \
+  0x00,                                               /* bInterval: ignored for bulk */                           \
+  /* 64 */                                                                                                        \
+}
+
+#if (USBD_SELF_POWERED == 1U)
+#define USBD_HID_BULK_ATTRIBUTES 0xC0U
+#else
+#define USBD_HID_BULK_ATTRIBUTES 0x80U
+#endif
+
+__ALIGN_BEGIN static uint8_t USBD_HID_BULK_CfgFSDesc[USB_HID_BULK_CONFIG_DESC_SIZ] __ALIGN_END =
+  USBD_HID_BULK_CFG_DESC(CUSTOM_HID_FS_BINTERVAL, VENDOR_BULK_FS_MAX_PACKET);
+
+__ALIGN_BEGIN static uint8_t USBD_HID_BULK_CfgHSDesc[USB_HID_BULK_CONFIG_DESC_SIZ] __ALIGN_END =
+  USBD_HID_BULK_CFG_DESC(CUSTOM_HID_HS_BINTERVAL, VENDOR_BULK_HS_MAX_PACKET);
+
+__ALIGN_BEGIN static uint8_t USBD_HID_BULK_OtherSpeedCfgDesc[USB_HID_BULK_CONFIG_DESC_SIZ] __ALIGN_END =
+  USBD_HID_BULK_CFG_DESC(CUSTOM_HID_FS_BINTERVAL, VENDOR_BULK_FS_MAX_PACKET);
+
+
+/* The bulk state, the HID state stays in the pClassData owned by the USBD_CUSTOM_HID class */
+static CUSTOM_HID_StateTypeDef bulkState = CUSTOM_HID_IDLE;
+static uint8_t  *bulkOutBuf = NULL;
+static uint32_t bulkInZlp   = 0U;
+static uint8_t  bulkAltSetting = 0U;
+
+
+static uint32_t USBD_HID_BULK_MaxPacket(USBD_HandleTypeDef *pdev)
+{
+  return (pdev->dev_speed == USBD_SPEED_HIGH) ? VENDOR_BULK_HS_MAX_PACKET : VENDOR_BULK_FS_MAX_PACKET;
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_Init
+  *         Initialize the HID interface and open the vendor bulk EPs
+  * @param  pdev: device instance
+  * @param  cfgidx: Configuration index
+  * @retval status
+  */
+static uint8_t USBD_HID_BULK_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+  uint8_t ret = USBD_CUSTOM_HID.Init(pdev, cfgidx);
+
+  if (ret != (uint8_t)USBD_OK)
+  {
+    return ret;
+  }
+
+  (void)USBD_LL_OpenEP(pdev, VENDOR_BULK_EPIN_ADDR, USBD_EP_TYPE_BULK, (uint16_t)USBD_HID_BULK_MaxPacket(pdev));
+  pdev->ep_in[VENDOR_BULK_EPIN_ADDR & 0xFU].is_used = 1U;
+
+  (void)USBD_LL_OpenEP(pdev, VENDOR_BULK_EPOUT_ADDR, USBD_EP_TYPE_BULK, (uint16_t)USBD_HID_BULK_MaxPacket(pdev));
+  pdev->ep_out[VENDOR_BULK_EPOUT_ADDR & 0xFU].is_used = 1U;
+
+  bulkState      = CUSTOM_HID_IDLE;
+  bulkInZlp      = 0U;
+  bulkAltSetting = 0U;
+
+  /* The OUT EP receives straight into the jtag request buffer */
+  jtag_usb_bulkArm();
+
+  return (uint8_t)USBD_OK;
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_DeInit
+  *         Close the vendor bulk EPs and DeInitialize the HID interface
+  * @param  pdev: device instance
+  * @param  cfgidx: Configuration index
+  * @retval status
+  */
+static uint8_t USBD_HID_BULK_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+  (void)USBD_LL_CloseEP(pdev, VENDOR_BULK_EPIN_ADDR);
+  pdev->ep_in[VENDOR_BULK_EPIN_ADDR & 0xFU].is_used = 0U;
+
+  (void)USBD_LL_CloseEP(pdev, VENDOR_BULK_EPOUT_ADDR);
+  pdev->ep_out[VENDOR_BULK_EPOUT_ADDR & 0xFU].is_used = 0U;
+
+  bulkOutBuf = NULL;
+
+  return USBD_CUSTOM_HID.DeInit(pdev, cfgidx);
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_Setup
+  *         Handle the standard requests of the vendor bulk interface, everything else is for the HID
+  * @param  pdev: instance
+  * @param  req: usb requests
+  * @retval status
+  */
+static uint8_t USBD_HID_BULK_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+  static uint16_t status_info = 0U;
+  USBD_StatusTypeDef ret = USBD_OK;
+
+  if (((req->bmRequest & USB_REQ_RECIPIENT_MASK) != USB_REQ_RECIPIENT_INTERFACE) ||
+      (LOBYTE(req->wIndex) != VENDOR_BULK_INTERFACE))
+  {
+    return USBD_CUSTOM_HID.Setup(pdev, req);
+  }
+
+  if (((req->bmRequest & USB_REQ_TYPE_MASK) != USB_REQ_TYPE_STANDARD) || (pdev->dev_state != USBD_STATE_CONFIGURED))
+  {
+    USBD_CtlError(pdev, req);
+    return (uint8_t)USBD_FAIL;
+  }
+
+  switch (req->bRequest)
+  {
+    case USB_REQ_GET_STATUS:
+      (void)USBD_CtlSendData(pdev, (uint8_t *)&status_info, 2U);
+      break;
+
+    case USB_REQ_GET_INTERFACE:
+      (void)USBD_CtlSendData(pdev, &bulkAltSetting, 1U);
+      break;
+
+    case USB_REQ_SET_INTERFACE:
+      if (req->wValue != 0U)
+      {
+        /* There is only the alternate setting 0 */
+        USBD_CtlError(pdev, req);
+        ret = USBD_FAIL;
+      }
+      break;
+
+    case USB_REQ_CLEAR_FEATURE:
+      break;
+
+    default:
+      USBD_CtlError(pdev, req);
+      ret = USBD_FAIL;
+      break;
+  }
+
+  return (uint8_t)ret;
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_EP0_RxReady
+  *         Control request data are only used by the HID (SET_REPORT)
+  * @param  pdev: device instance
+  * @retval status
+  */
+static uint8_t USBD_HID_BULK_EP0_RxReady(USBD_HandleTypeDef *pdev)
+{
+  return USBD_CUSTOM_HID.EP0_RxReady(pdev);
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_DataIn
+  *         handle data IN Stage
+  * @param  pdev: device instance
+  * @param  epnum: endpoint index
+  * @retval status
+  */
+static uint8_t USBD_HID_BULK_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+  if (epnum != (VENDOR_BULK_EPIN_ADDR & 0xFU))
+  {
+    return USBD_CUSTOM_HID.DataIn(pdev, epnum);
+  }
+
+  /* Transfer being multiple of the max packet size is terminated with a ZLP,
+  so the host doesn't wait for more data */
+  if (bulkInZlp == 1U)
+  {
+    bulkInZlp = 0U;
+    (void)USBD_LL_Transmit(pdev, VENDOR_BULK_EPIN_ADDR, NULL, 0U);
+    return (uint8_t)USBD_OK;
+  }
+
+  bulkState = CUSTOM_HID_IDLE;
+
+  /* Response was sent, the OUT EP can receive the next transfer */
+  jtag_usb_bulkSent();
+
+  return (uint8_t)USBD_OK;
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_DataOut
+  *         handle data OUT Stage
+  * @param  pdev: device instance
+  * @param  epnum: endpoint index
+  * @retval status
+  */
+static uint8_t USBD_HID_BULK_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+  if (epnum != (VENDOR_BULK_EPOUT_ADDR & 0xFU))
+  {
+    return USBD_CUSTOM_HID.DataOut(pdev, epnum);
+  }
+
+  /* The whole multi-packet transfer arrived (buffer full or a short packet received),
+  the main loop executes it and sends the responses back as one transfer */
+  jtag_usb_bulkReceived(bulkOutBuf, USBD_LL_GetRxDataSize(pdev, epnum));
+
+  return (uint8_t)USBD_OK;
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_Transmit
+  *         Send a multi-packet transfer through the vendor bulk IN endpoint
+  * @param  pdev: device instance
+  * @param  buf: pointer to data
+  * @param  len: length of the data (can be zero)
+  * @retval status
+  */
+uint8_t USBD_HID_BULK_Transmit(USBD_HandleTypeDef *pdev, uint8_t *buf, uint32_t len)
+{
+  if (pdev->pClassData == NULL)
+  {
+    return (uint8_t)USBD_FAIL;
+  }
+
+  if ((pdev->dev_state != USBD_STATE_CONFIGURED) || (bulkState != CUSTOM_HID_IDLE))
+  {
+    return (uint8_t)USBD_BUSY;
+  }
+
+  bulkState = CUSTOM_HID_BUSY;
+  bulkInZlp = ((len != 0U) && ((len % USBD_HID_BULK_MaxPacket(pdev)) == 0U)) ? 1U : 0U;
+  (void)USBD_LL_Transmit(pdev, VENDOR_BULK_EPIN_ADDR, buf, len);
+
+  return (uint8_t)USBD_OK;
+}
+
+
+/**
+  * @brief  USBD_HID_BULK_Receive
+  *         prepare the vendor bulk OUT endpoint for a multi-packet transfer
+  * @param  pdev: device instance
+  * @param  buf: buffer where the transfer is received
+  * @param  len: size of the buffer (multiple of the max packet size)
+  * @retval status
+  */
+uint8_t USBD_HID_BULK_Receive(USBD_HandleTypeDef *pdev, uint8_t *buf, uint32_t len)
+{
+  if (pdev->pClassData == NULL)
+  {
+    return (uint8_t)USBD_FAIL;
+  }
+
+  bulkOutBuf = buf;
+  (void)USBD_LL_PrepareReceive(pdev, VENDOR_BULK_EPOUT_ADDR, buf, len);
+
+  return (uint8_t)USBD_OK;
+}
+
+
+static uint8_t *USBD_HID_BULK_GetFSCfgDesc(uint16_t *length)
+{
+  *length = (uint16_t)sizeof(USBD_HID_BULK_CfgFSDesc);
+  return USBD_HID_BULK_CfgFSDesc;
+}
+
+
+static uint8_t *USBD_HID_BULK_GetHSCfgDesc(uint16_t *length)
+{
+  *length = (uint16_t)sizeof(USBD_HID_BULK_CfgHSDesc);
+  return USBD_HID_BULK_CfgHSDesc;
+}
+
+
+static uint8_t *USBD_HID_BULK_GetOtherSpeedCfgDesc(uint16_t *length)
+{
+  *length = (uint16_t)sizeof(USBD_HID_BULK_OtherSpeedCfgDesc);
+  return USBD_HID_BULK_OtherSpeedCfgDesc;
+}
+
+
+static uint8_t *USBD_HID_BULK_GetDeviceQualifierDesc(uint16_t *length)
+{
+  return USBD_CUSTOM_HID.GetDeviceQualifierDescriptor(length);
+}
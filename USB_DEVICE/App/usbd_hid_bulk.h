@@ -0,0 +1,40 @@
+/*
+ * usbd_hid_bulk.h
+ *
+ * Composite class of the ST custom HID class and a vendor specific bulk interface,
+ * the HID part is delegated to the unmodified USBD_CUSTOM_HID class
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: agent@local
+ *     License: GPLv2
+ */
+
+#ifndef __USBD_HID_BULK_H__
+#define __USBD_HID_BULK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "usbd_customhid.h"
+
+/* Vendor specific bulk interface, next to the HID interface, for multi-packet transfers */
+#define VENDOR_BULK_INTERFACE                        0x01U
+#define VENDOR_BULK_EPIN_ADDR                        0x82U
+#define VENDOR_BULK_EPOUT_ADDR                       0x02U
+#define VENDOR_BULK_FS_MAX_PACKET                    0x40U  // 64bytes
+#define VENDOR_BULK_HS_MAX_PACKET                    0x200U // 512bytes
+
+#define USB_HID_BULK_CONFIG_DESC_SIZ                 64U
+
+extern USBD_ClassTypeDef USBD_HID_BULK;
+
+uint8_t USBD_HID_BULK_Transmit(USBD_HandleTypeDef *pdev, uint8_t *buf, uint32_t len);
+
+uint8_t USBD_HID_BULK_Receive(USBD_HandleTypeDef *pdev, uint8_t *buf, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __USBD_HID_BULK_H__ */
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+#
+# usb_transport_benchmark.py
+#
+# Host side throughput comparison of the HID and vendor bulk transports,
+# both are fed with the same command stream and the responses are checked.
+#
+#     Author: agent@local
+#    License: GPLv2
+#
+# Requirements: pip install hidapi pyusb (on Windows the vendor interface 1
+# needs the WinUSB driver bound, for example with Zadig)
+#
+
+import argparse
+import struct
+import time
+
+import hid
+import usb.core
+import usb.util
+
+VID = 0x1209
+PID = 0xdeb0
+
+REPORT_SIZE = 64          # JTAG_USB_REPORT_SIZE
+FRAME_PAYLOAD = 60        # JTAG_USB_FRAME_PAYLOAD
+FRAME_CONTINUED = 1 << 0  # more frames of the same batch follow
+STREAM_SIZE = 4096        # JTAG_USB_STREAM_SIZE
+BULK_SIZE = 4096          # JTAG_USB_BULK_SIZE
+BULK_MAX_PACKET = 64      # full-speed bulk packet
+BULK_INTERFACE = 1
+BULK_EP_OUT = 0x02
+BULK_EP_IN = 0x82
+
+# Command IDs (api.hpp commandE + scanBitsE)
+CMD_PING = 1
+CMD_SET_DR_LEN = 9
+CMD_SCAN = 10
+CMD_EXTENDED = 15
+EXT_RESPONSE_FORMAT = 0
+SCAN_READ_WRITE = 1 << 4
+SCAN_DR = 1 << 5
+
+
+def make_group(index):
+    """One ID group: four 32-bit read-write DR scans (default DR length), each
+    responding with one word. Returns (request words, expected response count)."""
+    scan = CMD_SCAN | SCAN_READ_WRITE | SCAN_DR
+    ids = scan | scan << 8 | scan << 16 | scan << 24
+    data = [(index * 4 + i) & 0xffffffff for i in range(4)]
+    return [ids] + data, 4
+
+
+def pack(words):
+    return struct.pack('<%dI' % len(words), *words)
+
+
+def batches(groups, limit):
+    """Concatenate as many groups as fit into one batch (stream) of the given size."""
+    result = []
+    current, expected = b'', 0
+    for words, responses in groups:
+        chunk = pack(words)
+        if len(current) + len(chunk) > limit:
+            result.append((current, expected))
+            current, expected = b'', 0
+        current += chunk
+        expected += responses
+    if current:
+        result.append((current, expected))
+    return result
+
+
+def hid_batch(dev, payload, sequence):
+    """Send one batch as HID frames and collect its response frames.
+    Returns (response payload, amount of IN frames, next sequence)."""
+    # Split the batch into frames, all but the last one have the continued flag
+    for offset in range(0, max(len(payload), 1), FRAME_PAYLOAD):
+        part = payload[offset:offset + FRAME_PAYLOAD]
+        flags = FRAME_CONTINUED if offset + FRAME_PAYLOAD < len(payload) else 0
+        frame = struct.pack('<BBH', sequence & 0xff, flags, len(part)) + part
+        dev.write(b'\0' + frame.ljust(REPORT_SIZE, b'\0'))  # report ID 0 prefix
+        sequence += 1
+
+    # Collect the response frames of the batch
+    reply, frames = b'', 0
+    while True:
+        frame = bytes(dev.read(REPORT_SIZE, 1000))
+        frames += 1
+        _, flags, length = struct.unpack('<BBH', frame[:4])
+        if flags & ~FRAME_CONTINUED:
+            raise RuntimeError('HID batch failed with flags 0x%02x' % flags)
+        reply += frame[4:4 + length]
+        if not flags & FRAME_CONTINUED:
+            return reply, frames, sequence
+
+
+def bench_hid(groups):
+    dev = hid.device()
+    dev.open(VID, PID)
+    try:
+        sequence = 0
+        start = time.perf_counter()
+        for payload, expected in batches(groups, STREAM_SIZE):
+            reply, _, sequence = hid_batch(dev, payload, sequence)
+            if len(reply) != expected * 4:
+                raise RuntimeError('HID response has %d bytes, expected %d' % (len(reply), expected * 4))
+        return time.perf_counter() - start
+    finally:
+        dev.close()
+
+
+def bench_short_reads(reads, length, packed):
+    """Read-back DR scans of the given length, responded as words or bit-packed.
+    Returns (reads per IN report, reads per second)."""
+    scan = CMD_SCAN | SCAN_READ_WRITE | SCAN_DR
+    ids = scan | scan << 8 | scan << 16 | scan << 24
+    setup = [CMD_SET_DR_LEN | CMD_EXTENDED << 8 | EXT_RESPONSE_FORMAT << 12, length, 1 if packed else 0]
+
+    dev = hid.device()
+    dev.open(VID, PID)
+    try:
+        sequence = 0
+        _, _, sequence = hid_batch(dev, pack(setup), sequence)
+
+        groups = [([ids, 0, 0, 0, 0], 4) for _ in range(reads // 4)]
+        frames = 0
+        start = time.perf_counter()
+        for payload, expected in batches(groups, STREAM_SIZE):
+            reply, count, sequence = hid_batch(dev, payload, sequence)
+            frames += count
+            expected_bytes = ((expected * length + 31) // 32) * 4 if packed else expected * 4
+            if len(reply) != expected_bytes:
+                raise RuntimeError('response has %d bytes, expected %d' % (len(reply), expected_bytes))
+        elapsed = time.perf_counter() - start
+
+        hid_batch(dev, pack(setup[:1] + [32, 0]), sequence)  # back to the defaults
+        return reads / frames, reads / elapsed
+    finally:
+        dev.close()
+
+
+def bench_bulk(groups):
+    dev = usb.core.find(idVendor=VID, idProduct=PID)
+    if dev is None:
+        raise RuntimeError('device not found')
+    usb.util.claim_interface(dev, BULK_INTERFACE)
+    try:
+        transfers = batches(groups, BULK_SIZE)
+
+        start = time.perf_counter()
+        for payload, expected in transfers:
+            # The device completes the OUT transfer on a short packet (or full buffer),
+            # a zero ID word keeps the length off the packet boundary and ends the parsing
+            if len(payload) < BULK_SIZE and len(payload) % BULK_MAX_PACKET == 0:
+                payload += b'\0' * 4
+            dev.write(BULK_EP_OUT, payload, 1000)
+            reply = dev.read(BULK_EP_IN, BULK_SIZE * 2, 1000)
+            if len(reply) != expected * 4:
+                raise RuntimeError('bulk response has %d bytes, expected %d' % (len(reply), expected * 4))
+        return time.perf_counter() - start
+    finally:
+        usb.util.release_interface(dev, BULK_INTERFACE)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare HID and vendor bulk command throughput')
+    parser.add_argument('--groups', type=int, default=2000, help='amount of 4-command groups to send')
+    parser.add_argument('--read-bits', type=int, default=3, help='length of the short reads in the packed response comparison')
+    args = parser.parse_args()
+
+    groups = [make_group(i) for i in range(args.groups)]
+    commands = args.groups * 4
+
+    for name, bench in (('HID ', bench_hid), ('bulk', bench_bulk)):
+        elapsed = bench(groups)
+        print('%s %8.3fs %10.0f cmd/s' % (name, elapsed, commands / elapsed))
+
+    for name, packed in (('word  ', False), ('packed', True)):
+        per_report, per_second = bench_short_reads(commands, args.read_bits, packed)
+        print('%s %d-bit reads %6.1f reads/report %10.0f reads/s' % (name, args.read_bits, per_report, per_second))
+
+
+if __name__ == '__main__':
+    main()